@@ -87,6 +87,44 @@ struct AABB {
         return true;
     }
 
+    static AABB empty() {
+        AABB box;
+        box.box_l = Vec3(INFINITY, INFINITY, INFINITY);
+        box.box_h = Vec3(-INFINITY, -INFINITY, -INFINITY);
+        return box;
+    }
+
+    void expand(const Vec3& p) { box_l = min(box_l, p), box_h = max(box_h, p); }
+    void expand(const AABB& b) { box_l = min(box_l, b.box_l), box_h = max(box_h, b.box_h); }
+
+    Vec3 centroid() const { return (box_l + box_h) * .5; }
+
+    double surfaceArea() const {
+        Vec3 d = box_h - box_l;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // slab test against a ray given by its origin and reciprocal direction,
+    // clipped to [t_min, t_max]; on success t_entry is the entering distance
+    bool intersect(const Vec3& o, const Vec3& inv_d, double t_min, double t_max,
+                   double& t_entry) const {
+        double t0 = (box_l.x - o.x) * inv_d.x, t1 = (box_h.x - o.x) * inv_d.x;
+        if (t0 > t1) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        t0 = (box_l.y - o.y) * inv_d.y, t1 = (box_h.y - o.y) * inv_d.y;
+        if (t0 > t1) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        t0 = (box_l.z - o.z) * inv_d.z, t1 = (box_h.z - o.z) * inv_d.z;
+        if (t0 > t1) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        t_entry = t_min;
+        return t_min <= t_max;
+    }
+
     bool intersect(Vec3 triangle[3]) {
         //TODO: implement this for kd-tree
 
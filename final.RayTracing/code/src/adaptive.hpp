@@ -0,0 +1,56 @@
+#ifndef ADAPTIVE_HPP_
+#define ADAPTIVE_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+
+inline double luminance(const Vec3& c) {
+    return .2126 * c.x + .7152 * c.y + .0722 * c.z;
+}
+
+// Sample count of one subpixel, with the variance of the luminance kept by
+// Welford's algorithm. The colors themselves go to the Film. Floats keep a
+// full HD frame of subpixels at 16 bytes each.
+struct SampleStats {
+    int n;
+    bool converged;
+    float lum_mean, lum_m2; // mean and sum of squared deviations
+
+    SampleStats() : n(0), converged(false), lum_mean(0), lum_m2(0) {}
+
+    void add(const Vec3& c) {
+        n++;
+        float lum = luminance(c);
+        float delta = lum - lum_mean;
+        lum_mean += delta / n;
+        lum_m2 += delta * (lum - lum_mean);
+    }
+
+    // pool the samples of other into this one (Chan et al.)
+    void merge(const SampleStats& other) {
+        if (other.n == 0)
+            return;
+        int total = n + other.n;
+        float delta = other.lum_mean - lum_mean;
+        lum_m2 += other.lum_m2 + delta * delta * ((float) n * other.n / total);
+        lum_mean += delta * other.n / total;
+        n = total;
+    }
+
+    // Standard error of the mean luminance relative to the mean. The
+    // floor lets black subpixels converge as well.
+    double relativeError() const {
+        if (n < 2)
+            return INFINITY;
+        double variance = lum_m2 / (n - 1);
+        return sqrt(variance / n) / std::max((double) lum_mean, 1e-2);
+    }
+};
+
+// blue -> cyan -> yellow -> red for t in [0, 1]
+inline Vec3 heatmapColor(double t) {
+    t = clamp(t);
+    return Vec3(clamp(1.5 - fabs(4 * t - 3)), clamp(1.5 - fabs(4 * t - 2)), clamp(1.5 - fabs(4 * t - 1)));
+}
+
+#endif // ADAPTIVE_HPP_
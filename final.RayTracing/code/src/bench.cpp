@@ -0,0 +1,808 @@
+// Micro benchmarks for the hot paths of the renderer.
+// Run from this directory so that ./resources resolves:
+//     ./bench <name>...      (no name runs everything)
+#include "common.hpp"
+#include "vec.hpp"
+#include "helpers.hpp"
+#include "object3d.hpp"
+#include "mesh.hpp"
+#include "simd.hpp"
+#include "obj_parser.hpp"
+#include "scenes.hpp"
+#include <dirent.h>
+
+using namespace std;
+
+template <class F>
+double timeIt(F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// rays from a sphere around box aimed at random points inside it
+vector<Ray> raysAt(const AABB& box, int count, uint32_t seed) {
+    vector<Ray> rays;
+    Vec3 c = box.centroid(), ext = box.box_h - box.box_l;
+    double radius = ext.len();
+    RandomSampler sampler(count, seed);
+    for (int i = 0; i < count; i++) {
+        sampler.startSample(0, 0, i);
+        Vec3 o = Vec3::random_in_unit_disk(sampler.get2D());
+        o = (c + Vec3(o.x, o.y, sampler.get1D() * 2 - 1).normalized() * radius);
+        Vec3 u = sampler.get2D();
+        Vec3 target = box.box_l + ext * Vec3(u.x, u.y, sampler.get1D());
+        rays.emplace_back(o, (target - o).normalized());
+    }
+    return rays;
+}
+
+// the test Mesh used before the Moller-Trumbore kernel: build a Triangle,
+// intersect its plane, then solve for barycentrics from scratch
+bool legacyTriangleIntersect(const Vec3& a, const Vec3& b, const Vec3& c,
+                             const Ray& ray, double tmin, double& t) {
+    Vec3 normal = (b-a).cross(c-a).normalized();
+    double m = ray.dir.dot(normal);
+    if (fabs(m) < 1e-9)
+        return false;
+    t = (normal.dot(a) - normal.dot(ray.origin)) / m;
+    if (t <= tmin)
+        return false;
+    Vec3 p = ray.pointAtParameter(t);
+    Vec3 v0 = c - a;
+    Vec3 v1 = b - a;
+    Vec3 v2 = p - a;
+    double denominator = v0.len2()*v1.len2() - v0.dot(v1)*v1.dot(v0);
+    double u = (v1.len2()*v2.dot(v0) - v1.dot(v0)*v2.dot(v1)) / denominator;
+    double v = (v0.len2()*v2.dot(v1) - v0.dot(v1)*v2.dot(v0)) / denominator;
+    return 0 <= u && u <= 1 && 0 <= v && v <= 1 && u + v <= 1;
+}
+
+void benchTriangle() {
+    Mesh mesh("./resources/bunny.fine.obj", nullptr);
+    AABB box;
+    mesh.getBounds(box);
+    auto rays = raysAt(box, 64, 1);
+    long long tests = (long long) rays.size() * mesh.t.size();
+
+    int legacy_hits = 0, mt_hits = 0;
+    double legacy_s = timeIt([&]() {
+        for (auto& r : rays) {
+            for (auto& tri : mesh.t) {
+                double t;
+                legacy_hits += legacyTriangleIntersect(
+                    mesh.v[tri.x[0]], mesh.v[tri.x[1]], mesh.v[tri.x[2]], r, eps, t);
+            }
+        }
+    });
+    double mt_s = timeIt([&]() {
+        for (auto& r : rays) {
+            for (auto& tri : mesh.tris) {
+                double t, u, v;
+                mt_hits += intersectTriangle(r, tri.v0, tri.e1, tri.e2, eps, INFINITY, t, u, v);
+            }
+        }
+    });
+    printf("triangle: %lld tests\n", tests);
+    printf("  plane + barycentric : %8.2f Mtests/s (%d hits)\n", tests / legacy_s * 1e-6, legacy_hits);
+    printf("  moller-trumbore     : %8.2f Mtests/s (%d hits)\n", tests / mt_s * 1e-6, mt_hits);
+}
+
+// SoA packets against the scalar kernel on bunny.fine, first on every
+// triangle to measure raw kernel throughput, then through the BVH
+void benchPackets() {
+    // the scalar path gets a BVH with its own leaf sizes
+    SimdLevel best = simd_level;
+    simd_level = SimdLevel::SCALAR;
+    Mesh scalar_mesh("./resources/bunny.fine.obj", nullptr);
+    simd_level = best;
+    Mesh mesh("./resources/bunny.fine.obj", nullptr);
+    AABB box;
+    mesh.getBounds(box);
+    auto rays = raysAt(box, 64, 2);
+    long long tests = (long long) rays.size() * mesh.t.size();
+
+    printf("packets: %lld triangle tests, %d packets\n", tests, (int) mesh.packets.size());
+    double scalar_rate = 0;
+    for (auto level : {SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2}) {
+        if (level > best) continue;
+        int hits = 0;
+        double s = timeIt([&]() {
+            for (auto& r : rays) {
+                if (level == SimdLevel::SCALAR) {
+                    for (auto& tri : mesh.tris) {
+                        double t, u, v;
+                        hits += intersectTriangle(r, tri.v0, tri.e1, tri.e2, eps, INFINITY, t, u, v);
+                    }
+                    continue;
+                }
+                PacketRay pr(r.origin, r.dir, eps, INFINITY);
+                for (auto& packet : mesh.packets) {
+                    int mask = packetCandidates(packet, pr, level);
+                    while (mask) {
+                        int lane = __builtin_ctz(mask);
+                        mask &= mask - 1;
+                        const auto& tri = mesh.tris[packet.id[lane]];
+                        double t, u, v;
+                        hits += intersectTriangle(r, tri.v0, tri.e1, tri.e2, eps, INFINITY, t, u, v);
+                    }
+                }
+            }
+        });
+        double rate = tests / s;
+        if (level == SimdLevel::SCALAR) scalar_rate = rate;
+        printf("  %-6s : %8.2f Mtriangles/s, %5.2fx (%d hits)\n",
+               simdLevelName(level), rate * 1e-6, rate / scalar_rate, hits);
+    }
+
+    auto bvh_rays = raysAt(box, 200000, 3);
+    for (auto level : {SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2}) {
+        if (level > best) continue;
+        simd_level = level;
+        Mesh& m = level == SimdLevel::SCALAR ? scalar_mesh : mesh;
+        double t_sum = 0;
+        double s = timeIt([&]() {
+            for (auto& r : bvh_rays) {
+                Hit h;
+                if (m.intersect(r, h, eps)) t_sum += h.t;
+            }
+        });
+        printf("  %-6s : %8.2f Mrays/s through the BVH (t sum %.6f)\n",
+               simdLevelName(level), bvh_rays.size() / s * 1e-6, t_sum);
+    }
+    simd_level = best;
+}
+
+// Camera rays of every pixel of scene, one jittered sample each, block by
+// block: ray by ray through Group::intersect against PACKET_BLOCK^2 pixel
+// packets. The packets have to find exactly the same hits.
+void benchPrimaryScene(const char* name, const Scene& scene) {
+    scene.group->build();
+    Camera* cam = scene.camera;
+    RandomSampler sampler(1, 24);
+    vector<Ray> rays;
+    vector<size_t> blocks; // first ray of every block, then the end
+    for (int by = 0; by < cam->height; by += PACKET_BLOCK)
+        for (int bx = 0; bx < cam->width; bx += PACKET_BLOCK) {
+            blocks.push_back(rays.size());
+            for (int y = by; y < min(by + PACKET_BLOCK, cam->height); y++)
+                for (int x = bx; x < min(bx + PACKET_BLOCK, cam->width); x++) {
+                    sampler.startSample(x, y, 0);
+                    Vec3 u = sampler.get2D();
+                    rays.push_back(cam->generateRay(Vec3(x + u.x, y + u.y), sampler));
+                }
+        }
+    blocks.push_back(rays.size());
+    vector<Hit> single(rays.size());
+    // the best of a few runs, a whole frame of rays is short
+    auto bestTime = [](function<void()> f) {
+        double best = INFINITY;
+        for (int run = 0; run < 3; run++)
+            best = min(best, timeIt(f));
+        return best;
+    };
+    double single_s = bestTime([&]() {
+        for (size_t i = 0; i < rays.size(); i++) {
+            single[i] = Hit();
+            scene.group->intersect(rays[i], single[i], eps);
+        }
+    });
+    printf("  %-10s %8.2f", name, rays.size() / single_s * 1e-6);
+    SimdLevel best = simd_level;
+    unique_ptr<RayPacket> packet(new RayPacket());
+    int mismatches = 0;
+    auto tracePackets = [&](bool check) {
+        for (size_t b = 0; b + 1 < blocks.size(); b++) {
+            size_t first = blocks[b], end = blocks[b + 1];
+            packet->clear(eps);
+            for (size_t i = first; i < end; i++)
+                packet->add(rays[i]);
+            packet->finish();
+            scene.group->intersectPacket(*packet, packet->lanes());
+            for (size_t i = first; check && i < end; i++) {
+                const Hit& h = packet->hits[i - first];
+                mismatches += h.material != single[i].material || (h.material && h.t != single[i].t)
+                    || h.object != single[i].object;
+            }
+        }
+    };
+    for (auto level : {SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2}) {
+        if (level > best) continue;
+        simd_level = level;
+        double s = bestTime([&]() { tracePackets(false); });
+        tracePackets(true);
+        printf(" %8.2f", rays.size() / s * 1e-6);
+    }
+    simd_level = best;
+    printf("   %zu rays%s\n", rays.size(), mismatches ? " MISMATCH" : "");
+}
+
+// primary visibility, the ray by ray path against the packets
+void benchPrimary() {
+    printf("primary: Mrays/s, packets of %dx%d pixels by box kernel\n", PACKET_BLOCK, PACKET_BLOCK);
+    printf("  %-10s %8s %8s %8s %8s\n", "scene", "single", "scalar", "sse", "avx2");
+    benchPrimaryScene("scene1", getScene1());
+    benchPrimaryScene("scene4", getScene4());
+    // the bunny alone, filling the frame
+    Group* g = new Group;
+    g->addObject(new Transform(Mat44::translation(0, -2.6, 0).mult(Mat44::scaling(25, 25, 25)),
+                               new Mesh("./resources/bunny.fine.obj", &materials[0], MESH_SMOOTH_NORMALS)));
+    benchPrimaryScene("bunny", Scene(new PerspectiveCamera(Vec3(0, 0, 5), Vec3(0, 0, -1), Vec3(0, 1, 0),
+                                                           600, 400, M_PI / 3.2), g));
+}
+
+// shadow rays on bunny.fine: closest hit against the any-hit query
+void benchOcclusion() {
+    Mesh mesh("./resources/bunny.fine.obj", nullptr);
+    AABB box;
+    mesh.getBounds(box);
+    auto rays = raysAt(box, 200000, 4);
+    int closest_hits = 0, occluded = 0;
+    double closest_s = timeIt([&]() {
+        for (auto& r : rays) {
+            Hit h;
+            closest_hits += mesh.intersect(r, h, eps);
+        }
+    });
+    double occluded_s = timeIt([&]() {
+        for (auto& r : rays)
+            occluded += mesh.occluded(r, eps, INFINITY);
+    });
+    printf("occlusion: %d rays\n", (int) rays.size());
+    printf("  intersect : %8.2f Mrays/s (%d hits)\n", rays.size() / closest_s * 1e-6, closest_hits);
+    printf("  occluded  : %8.2f Mrays/s (%d hits)\n", rays.size() / occluded_s * 1e-6, occluded);
+}
+
+// closest hits on bunny.fine with flat and with interpolated normals; the
+// corner attributes are only read once per ray
+void benchShading() {
+    Mesh flat("./resources/bunny.fine.obj", nullptr);
+    Mesh smooth("./resources/bunny.fine.obj", nullptr, MESH_SMOOTH_NORMALS);
+    AABB box;
+    flat.getBounds(box);
+    auto rays = raysAt(box, 200000, 5);
+    printf("shading: %d rays, %d bytes of corner attributes per triangle\n",
+           (int) rays.size(), (int) sizeof(Mesh::TriangleShading));
+    for (Mesh* mesh : {&flat, &smooth}) {
+        int hits = 0;
+        double n_sum = 0;
+        double s = timeIt([&]() {
+            for (auto& r : rays) {
+                Hit h;
+                if (mesh->intersect(r, h, eps)) {
+                    hits++;
+                    n_sum += h.normal.y;
+                }
+            }
+        });
+        printf("  %-6s : %8.2f Mrays/s (%d hits, normal y sum %.3f)\n",
+               mesh->smooth ? "smooth" : "flat", rays.size() / s * 1e-6, hits, n_sum);
+    }
+}
+
+// The quad-tree RevSurface had before it was flattened: nodes with child
+// pointers and double boxes, searched recursively. Built over the leaf boxes
+// of the flat tree, in the same shape.
+struct LegacyRevTree {
+    enum class NodeType {
+        LEAF,
+        INTERNAL
+    };
+    struct Node {
+        NodeType type;
+        Node* children[4];
+        // u[2]: theta_min, theta_max; v[2]: t_min, t_max
+        double u[2], v[2];
+        AABB box;
+
+        Node() {}
+        Node (Node* c1, Node* c2):
+            type(NodeType::INTERNAL), children{c1, c2, nullptr, nullptr},
+            box(c1->box, c2->box) {}
+        Node (Node* c1, Node* c2, Node* c3, Node* c4):
+            type(NodeType::INTERNAL), children{c1, c2, c3, c4},
+            box(c1->box, c2->box, c3->box, c4->box) {}
+        Node (double u0, double u1, double v0, double v1, const AABB& _box):
+            type(NodeType::LEAF), u{u0, u1}, v{v0, v1}, box(_box) {}
+    };
+    vector<Node> nodes;
+    int root, node_cnt, steps;
+
+    explicit LegacyRevTree(const RevSurface& rs) : steps(rs.steps) {
+        int rows = rs.points_cnt - 1;
+        nodes.resize(2 * rows * steps);
+        for (int i = 0; i < rs.node_cnt; i++) {
+            const RevSurface::Node& node = rs.nodes[i];
+            if (node.count > 0) continue;
+            int row = node.first / steps, col = node.first % steps;
+            AABB box(Vec3(node.box_l[0], node.box_l[1], node.box_l[2]),
+                     Vec3(node.box_h[0], node.box_h[1], node.box_h[2]));
+            nodes[node.first] = Node(2 * M_PI * col / steps, 2 * M_PI * (col + 1) / steps,
+                                     rs.row_s[row], rs.row_s[row + 1], box);
+        }
+        node_cnt = rows * steps;
+        root = createTree(0, steps, 0, rows);
+    }
+
+    int createTree(int left, int right, int bottom, int top) {
+        int width = right - left, height = top - bottom;
+        if (width == 1 && height == 1)
+            return bottom*steps + left;
+        if (width <= 2 && height <= 2) {
+            if (width == 1)
+                nodes[node_cnt] = Node(&nodes[bottom*steps+left], &nodes[(bottom+1)*steps+left]);
+            else if (height == 1)
+                nodes[node_cnt] = Node(&nodes[bottom*steps+left], &nodes[bottom*steps+left+1]);
+            else
+                nodes[node_cnt] = Node(&nodes[bottom*steps+left], &nodes[bottom*steps+left+1],
+                                       &nodes[(bottom+1)*steps+left], &nodes[(bottom+1)*steps+left+1]);
+            return node_cnt++;
+        }
+        int w_mid = left + ((right - left) >> 1);
+        int h_mid = bottom + ((top - bottom) >> 1);
+        if (width <= 2 || height <= 2) { // halve the long side
+            int c1 = width <= 2 ? createTree(left, right, bottom, h_mid) : createTree(left, w_mid, bottom, top);
+            int c2 = width <= 2 ? createTree(left, right, h_mid, top) : createTree(w_mid, right, bottom, top);
+            nodes[node_cnt] = Node(&nodes[c1], &nodes[c2]);
+            return node_cnt++;
+        }
+        int c1 = createTree(left, w_mid, bottom, h_mid);
+        int c2 = createTree(left, w_mid, h_mid, top);
+        int c3 = createTree(w_mid, right, bottom, h_mid);
+        int c4 = createTree(w_mid, right, h_mid, top);
+        nodes[node_cnt] = Node(&nodes[c1], &nodes[c2], &nodes[c3], &nodes[c4]);
+        return node_cnt++;
+    }
+
+    // the recursive leaf search the profile root finder started with
+    void collectLeaves(Node* node, const Ray& r, double tmin, double tmax,
+                       vector<pair<double, int>>& leaves) {
+        double t_near, t_far;
+        if (!node->box.intersect(r, t_near, t_far) || t_far < tmin || t_near > tmax)
+            return;
+        if (node->type == NodeType::LEAF) {
+            leaves.emplace_back(t_near, node - nodes.data());
+            return;
+        }
+        for (int i = 0; i < 4; i++)
+            if (node->children[i] != nullptr)
+                collectLeaves(node->children[i], r, tmin, tmax, leaves);
+    }
+};
+
+// the RevSurface intersector before the profile root finder: Newton on
+// (t, theta, s) from the middle of the first quad-tree leaf hit
+pair<LegacyRevTree::Node*, pair<double, double>> legacyIntersectTree(LegacyRevTree::Node* node, const Ray& r) {
+    double t_near, t_far;
+    if (!node->box.intersect(r, t_near, t_far))
+        return {nullptr, {0, 0}};
+    if (node->type == LegacyRevTree::NodeType::LEAF)
+        return {node, {t_near, t_far}};
+    LegacyRevTree::Node* res = nullptr;
+    bool has_intersect = false;
+    for (int i = 0; i < 4; i++) {
+        if (node->children[i] == nullptr) continue;
+        auto result = legacyIntersectTree(node->children[i], r);
+        if (result.first != nullptr) {
+            double tn = result.second.first, tf = result.second.second;
+            bool cond1 = t_near > 0 && tn > 0 && tn < t_near;
+            bool cond2 = t_near < 0 && tn > 0;
+            bool cond3 = t_near < 0 && tn < 0 && tf < t_far;
+            if (!has_intersect || cond1 || cond2 || cond3) {
+                res = result.first;
+                t_near = tn;
+                t_far = tf;
+            }
+        }
+    }
+    return {res, {t_near, t_far}};
+}
+
+bool legacyRevSurfaceIntersect(RevSurface& rs, LegacyRevTree& tree, const Ray& r, double tmin, double& t) {
+    auto result = legacyIntersectTree(&tree.nodes[tree.root], r);
+    if (result.first == nullptr)
+        return false;
+    LegacyRevTree::Node* leaf = result.first;
+    auto v_bound = rs.pCurve->get_valid_range();
+    Vec3 x0((result.second.first + result.second.second) / 2,
+            (leaf->u[0] + leaf->u[1]) / 2, (leaf->v[0] + leaf->v[1]) / 2);
+    for (int i = 0; i < 1000; i++) {
+        if (x0.z < v_bound.first || x0.z > v_bound.second) return false;
+        auto curvePoint = rs.pCurve->evaluate(x0.z);
+        Vec3 p = curvePoint.first, dp = curvePoint.second;
+        Vec3 f = r.pointAtParameter(x0.x) - rs.getPoint(p, x0.y);
+        if (f.max() < eps && f.min() > -eps && x0.x > tmin) {
+            t = x0.x;
+            return true;
+        } else if (x0.x < -.05 || x0.y < 0 || x0.y >= 2*M_PI) {
+            return false;
+        }
+        Vec3 du(-sin(x0.y)*p.x, cos(x0.y)*p.x, 0);
+        Vec3 dv(cos(x0.y)*dp.x, sin(x0.y)*dp.x, dp.y);
+        x0 = x0 - Mat44(r.dir, -du, -dv).inversed().mult(f, false);
+    }
+    return false;
+}
+
+// rays at the wineglass of scene 3, against the old Newton intersector
+void benchRevSurface() {
+    RevSurface glass(new BsplineCurve(bspline_wineglass), nullptr);
+    LegacyRevTree tree(glass);
+    AABB box;
+    glass.getBounds(box);
+    auto rays = raysAt(box, 20000, 6);
+    vector<double> legacy_t(rays.size(), -1), new_t(rays.size(), -1);
+    double legacy_s = timeIt([&]() {
+        for (size_t i = 0; i < rays.size(); i++) {
+            double t;
+            if (legacyRevSurfaceIntersect(glass, tree, rays[i], eps, t)) legacy_t[i] = t;
+        }
+    });
+    double new_s = timeIt([&]() {
+        for (size_t i = 0; i < rays.size(); i++) {
+            Hit h;
+            if (glass.intersect(rays[i], h, eps)) new_t[i] = h.t;
+        }
+    });
+    int both = 0, agree = 0, legacy_only = 0, new_only = 0;
+    for (size_t i = 0; i < rays.size(); i++) {
+        if (legacy_t[i] >= 0 && new_t[i] >= 0) {
+            both++;
+            agree += fabs(legacy_t[i] - new_t[i]) < 1e-6;
+        } else {
+            legacy_only += legacy_t[i] >= 0;
+            new_only += new_t[i] >= 0;
+        }
+    }
+    printf("revsurface: %d rays at the wineglass\n", (int) rays.size());
+    printf("  newton        : %8.1f krays/s\n", rays.size() / legacy_s * 1e-3);
+    printf("  profile roots : %8.1f krays/s\n", rays.size() / new_s * 1e-3);
+    printf("  both hit %d (same t: %d), only newton %d, only profile roots %d\n",
+           both, agree, legacy_only, new_only);
+
+    // leaf search alone: recursive over pointers and doubles, flat and
+    // iterative over floats
+    vector<pair<double, int>> leaves;
+    size_t legacy_leaves = 0, flat_leaves = 0;
+    int same = 0;
+    legacy_s = timeIt([&]() {
+        for (auto& r : rays) {
+            leaves.clear();
+            tree.collectLeaves(&tree.nodes[tree.root], r, eps, INFINITY, leaves);
+            sort(leaves.begin(), leaves.end());
+            legacy_leaves += leaves.size();
+        }
+    });
+    new_s = timeIt([&]() {
+        for (auto& r : rays) {
+            glass.collectLeaves(r, eps, INFINITY, leaves);
+            flat_leaves += leaves.size();
+        }
+    });
+    vector<int> a, b;
+    for (auto& r : rays) {
+        leaves.clear();
+        tree.collectLeaves(&tree.nodes[tree.root], r, eps, INFINITY, leaves);
+        a.clear();
+        for (auto& leaf : leaves) a.push_back(leaf.second);
+        glass.collectLeaves(r, eps, INFINITY, leaves);
+        b.clear();
+        for (auto& leaf : leaves) b.push_back(leaf.second);
+        sort(a.begin(), a.end());
+        sort(b.begin(), b.end());
+        same += a == b;
+    }
+    printf("  leaves: recursive %8.1f krays/s, flat %8.1f krays/s, %.1f vs %.1f leaves per ray, same set for %d rays\n",
+           rays.size() / legacy_s * 1e-3, rays.size() / new_s * 1e-3,
+           (double) legacy_leaves / rays.size(), (double) flat_leaves / rays.size(), same);
+    printf("  %d nodes of %d bytes\n", glass.node_cnt, (int) sizeof(RevSurface::Node));
+
+    // Grazing rays: in a plane through the axis, parallel to the profile
+    // tangent at a random point and moved 1e-7 to 2e-7 towards its bend, so
+    // they cross the profile twice close together. Checked against the
+    // closest sign change of g among dense samples of the whole profile.
+    const PowerBasisCurve& curve = glass.pCurve->powerBasis();
+    auto range = glass.pCurve->get_valid_range();
+    RandomSampler sampler(1, 17);
+    const int grazing = 2000, dense = 200000;
+    int checked = 0, missed = 0, wrong = 0;
+    for (int i = 0; i < grazing; i++) {
+        sampler.startSample(0, 0, i);
+        double s0 = range.first + (range.second - range.first) * (.05 + .9 * sampler.get1D());
+        Vec3 p, dp, ddp;
+        curve.evaluate(s0, p, dp, ddp);
+        Vec3 tangent = Vec3(dp.x, dp.y).normalized();
+        Vec3 bend = Vec3(ddp.x, ddp.y) - tangent * Vec3(ddp.x, ddp.y).dot(tangent);
+        if (bend.len() < 1e-9)
+            continue;
+        Vec3 o = p + bend.normalized() * (1e-7 * (1 + sampler.get1D())) - tangent;
+        Ray r(Vec3(o.x, 0, o.y), Vec3(tangent.x, 0, tangent.y));
+        RevSurface::RayProfile profile(r);
+        double t_ref = INFINITY, g_prev = 0, dg, t;
+        for (int branch = -1; branch <= 1; branch += 2) {
+            if (profile.steep && branch > 0)
+                break;
+            bool prev = false;
+            for (int k = 0; k <= dense; k++) {
+                double g;
+                curve.evaluate(range.first + (range.second - range.first) * k / dense, p, dp);
+                bool ok = profile.eval(p, dp, branch, g, dg, t);
+                // where the profile runs along the axis there is no surface
+                if (ok && prev && (g > 0) != (g_prev > 0) && t > eps && fabs(p.x) > 1e-6)
+                    t_ref = std::min(t_ref, t);
+                prev = ok, g_prev = g;
+            }
+        }
+        if (t_ref == INFINITY)
+            continue;
+        checked++;
+        Hit h;
+        if (!glass.intersect(r, h, eps))
+            missed++;
+        else if (fabs(h.t - t_ref) > 1e-3)
+            wrong++;
+    }
+    printf("  grazing: %d rays that hit, %d missed, %d at another root\n", checked, missed, wrong);
+}
+
+// evaluations of a curve through its Bernstein basis and its power basis
+// form, with the loop for any degree and unrolled, at evenly spaced parameters
+void benchCurveEvaluate(const char* name, Curve& curve) {
+    const int count = 1000000;
+    auto range = curve.get_valid_range();
+    double step = (range.second - range.first) / (count - 1);
+    Vec3 sum_basis, sum_generic, sum_power;
+    double basis_s = timeIt([&]() {
+        for (int i = 0; i < count; i++) {
+            auto result = curve.evaluate(*curve.bern, range.first + i * step);
+            sum_basis += result.first + result.second;
+        }
+    });
+    double generic_s = timeIt([&]() {
+        Vec3 p, dp;
+        for (int i = 0; i < count; i++) {
+            curve.powerBasis().evaluateGeneric(range.first + i * step, p, dp);
+            sum_generic += p + dp;
+        }
+    });
+    double power_s = timeIt([&]() {
+        Vec3 p, dp;
+        for (int i = 0; i < count; i++) {
+            curve.powerBasis().evaluate(range.first + i * step, p, dp);
+            sum_power += p + dp;
+        }
+    });
+    double max_error = 0;
+    for (int i = 0; i < count; i += 97) {
+        auto a = curve.evaluate(*curve.bern, range.first + i * step);
+        auto b = curve.evaluate(range.first + i * step);
+        max_error = std::max(max_error, std::max((a.first - b.first).len(), (a.second - b.second).len()));
+    }
+    printf("  %-10s basis %7.2f  generic %7.2f  unrolled %7.2f Mevals/s, max difference %.2g\n", name,
+           count / basis_s * 1e-6, count / generic_s * 1e-6, count / power_s * 1e-6, max_error);
+    if (sum_basis.x == 12345) // keep the loops
+        printf("%f %f %f\n", sum_basis.x, sum_generic.x, sum_power.x);
+}
+
+void benchCurve() {
+    printf("curve: position and tangent\n");
+    BsplineCurve bspline(bspline_wineglass);
+    benchCurveEvaluate("bspline", bspline);
+    BezierCurve bezier(vector<Vec3>(bspline_wineglass.begin(), bspline_wineglass.begin() + 10));
+    benchCurveEvaluate("bezier", bezier);
+    BezierCurve cubic(vector<Vec3>(bspline_wineglass.begin(), bspline_wineglass.begin() + 4));
+    benchCurveEvaluate("cubic", cubic);
+}
+
+// texture lookups with every filter, at random points of a 1024x1024
+// texture, with footprints from a tenth of a texel to 64 texels
+void benchTexture() {
+    const int size = 1024, count = 2000000;
+    vector<unsigned char> rgb(size * size * 3);
+    RandomSampler sampler(count, 21);
+    for (auto& c : rgb) c = rand() & 0xff;
+    Texture texture;
+    double build_s = timeIt([&]() { texture.build(rgb.data(), size, size); });
+    vector<Vec3> uv(count), duv(count);
+    for (int i = 0; i < count; i++) {
+        sampler.startSample(0, 0, i);
+        uv[i] = sampler.get2D();
+        duv[i] = Vec3(pow(2., sampler.get1D() * 9.3 - 3.3) / size, 0);
+    }
+    printf("texture: %dx%d, %d levels, %.1f MB, built in %.1f ms\n", size, size,
+           (int) texture.levels.size(), texture.bytes() / 1e6, build_s * 1e3);
+    const char* names[] = {"nearest", "bilinear", "trilinear"};
+    for (auto filter : {TextureFilter::NEAREST, TextureFilter::BILINEAR, TextureFilter::TRILINEAR}) {
+        texture.filter = filter;
+        Vec3 sum;
+        double s = timeIt([&]() {
+            for (int i = 0; i < count; i++)
+                sum += texture.sample(uv[i], duv[i], Vec3(0, duv[i].x));
+        });
+        printf("  %-9s : %7.2f Mlookups/s (mean %.3f)\n", names[(int) filter], count / s * 1e-6, sum.x / count);
+    }
+
+    // the same texture through the cache, loaded by the first lookup
+    const char* path = "/tmp/bench_texture.ppm";
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr)
+        return;
+    fprintf(f, "P6 %d %d 255\n", size, size);
+    fwrite(rgb.data(), 1, rgb.size(), f);
+    fclose(f);
+    TextureHandle handle = TextureCache::instance().get(path);
+    handle.filter = TextureFilter::TRILINEAR;
+    Vec3 sum, c;
+    double load_s = timeIt([&]() { handle.sample(uv[0], duv[0], Vec3(), c); });
+    double s = timeIt([&]() {
+        for (int i = 0; i < count; i++)
+            if (handle.sample(uv[i], duv[i], Vec3(0, duv[i].x), c))
+                sum += c;
+    });
+    printf("  %-9s : %7.2f Mlookups/s (mean %.3f, loaded in %.1f ms)\n", "cached", count / s * 1e-6, sum.x / count, load_s * 1e3);
+    TextureCache::instance().reportStats();
+    handle = TextureHandle();
+    TextureCache::instance().collect();
+
+    // four textures sampled in turn with room for one and a half: a pass
+    // may go over the budget but holds each texture once, and collect()
+    // brings it back within
+    const int n_textures = 4, passes = 4;
+    size_t texture_bytes = texture.bytes(), budget = texture_bytes * 3 / 2;
+    vector<string> paths;
+    vector<TextureHandle> handles;
+    for (int i = 0; i < n_textures; i++) {
+        paths.push_back("/tmp/bench_texture" + to_string(i) + ".ppm");
+        f = fopen(paths[i].c_str(), "wb");
+        fprintf(f, "P6 %d %d 255\n", size, size);
+        fwrite(rgb.data(), 1, rgb.size(), f);
+        fclose(f);
+        handles.push_back(TextureCache::instance().get(paths[i]));
+    }
+    TextureCache& cache = TextureCache::instance();
+    cache.setBudget(budget);
+    auto before = cache.stats();
+    size_t peak = 0, after_collect = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        #pragma omp parallel for schedule(static, 1024)
+        for (int i = 0; i < count; i++) {
+            Vec3 c;
+            handles[(i / 1024 + pass) % n_textures].sample(uv[i], duv[i], Vec3(0, duv[i].x), c);
+        }
+        peak = std::max(peak, cache.stats().resident_bytes);
+        cache.collect();
+        after_collect = std::max(after_collect, cache.stats().resident_bytes);
+    }
+    auto after = cache.stats();
+    bool ok = peak <= n_textures * texture_bytes && after_collect <= budget;
+    printf("  %-9s : budget %.1f MB, %lld loads, peak %.1f MB, %.1f MB after collect (%s)\n", "evicting",
+           budget / 1e6, after.loads - before.loads, peak / 1e6, after_collect / 1e6, ok ? "ok" : "OVER");
+    handles.clear();
+    cache.collect();
+    cache.setBudget(TEXTURE_CACHE_BUDGET);
+    for (auto& p : paths)
+        remove(p.c_str());
+    remove(path);
+}
+
+// the loader Mesh used before ObjParser: a stringstream per line
+void legacyParseObj(const char* filename, vector<Vec3>& v, vector<Mesh::TriangleIndex>& t) {
+    std::ifstream f(filename);
+    std::string line, tok;
+    int texID;
+    while (std::getline(f, line)) {
+        if (line.size() < 3 || line.at(0) == '#') continue;
+        std::stringstream ss(line);
+        ss >> tok;
+        if (tok == "v") {
+            Vec3 vec;
+            ss >> vec.x >> vec.y >> vec.z;
+            v.push_back(vec);
+        } else if (tok == "f") {
+            Mesh::TriangleIndex trig;
+            if (line.find('/') != std::string::npos) {
+                std::replace(line.begin(), line.end(), '/', ' ');
+                std::stringstream facess(line);
+                facess >> tok;
+                for (int ii = 0; ii < 3; ii++) {
+                    facess >> trig[ii] >> texID;
+                    trig[ii]--;
+                }
+            } else {
+                for (int ii = 0; ii < 3; ii++) {
+                    ss >> trig[ii];
+                    trig[ii]--;
+                }
+            }
+            t.push_back(trig);
+        }
+    }
+}
+
+// OBJ parsing throughput on every file in resources, checked against the
+// old loader
+void benchObjParse() {
+    vector<string> paths;
+    DIR* dir = opendir("./resources");
+    for (dirent* entry; dir && (entry = readdir(dir));) {
+        string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0)
+            paths.push_back("./resources/" + name);
+    }
+    if (dir) closedir(dir);
+    sort(paths.begin(), paths.end());
+
+    printf("objparse: MB/s, %d threads for the parallel parser\n", workerCount());
+    printf("  %-32s %9s %9s %9s %9s\n", "file", "MB", "legacy", "mapped", "parallel");
+    double total_mb = 0, total_legacy = 0, total_single = 0, total_parallel = 0;
+    for (auto& path : paths) {
+        vector<Vec3> legacy_v;
+        vector<Mesh::TriangleIndex> legacy_t;
+        ObjData single, parallel;
+        double legacy_s = timeIt([&]() { legacyParseObj(path.c_str(), legacy_v, legacy_t); });
+        double single_s = timeIt([&]() { ObjParser::parse(path, single, 1); });
+        double parallel_s = timeIt([&]() { ObjParser::parse(path, parallel); });
+        // the legacy loader only keeps the first triangle of a polygon
+        bool same = legacy_v.size() == single.v.size() && single.v.size() == parallel.v.size()
+            && single.corners.size() == parallel.corners.size();
+        for (size_t i = 0; same && i < legacy_v.size(); i++)
+            same = legacy_v[i] == single.v[i] && single.v[i] == parallel.v[i];
+        for (size_t i = 0; same && i < single.corners.size(); i++)
+            same = single.corners[i].v == parallel.corners[i].v && single.corners[i].vt == parallel.corners[i].vt
+                && single.corners[i].vn == parallel.corners[i].vn;
+        if (same && (int) legacy_t.size() == single.triangles())
+            for (size_t i = 0; same && i < legacy_t.size(); i++)
+                for (int j = 0; j < 3; j++)
+                    same &= legacy_t[i][j] == single.corners[3 * i + j].v;
+        struct stat st;
+        stat(path.c_str(), &st);
+        double mb = st.st_size * 1e-6;
+        printf("  %-32s %9.2f %9.1f %9.1f %9.1f%s\n", path.c_str(), mb, mb / legacy_s, mb / single_s,
+               mb / parallel_s, same ? "" : "  MISMATCH");
+        total_mb += mb, total_legacy += legacy_s, total_single += single_s, total_parallel += parallel_s;
+    }
+    printf("  %-32s %9.2f %9.1f %9.1f %9.1f\n", "all", total_mb, total_mb / total_legacy,
+           total_mb / total_single, total_mb / total_parallel);
+}
+
+// startup cost of the big meshes: parsing the OBJ and building the BVH
+// against mapping the binary cache
+void benchMeshLoad() {
+    printf("meshload:\n");
+    for (const char* path : {"./resources/horse.fine.90k.obj", "./resources/kitten.50k.obj"}) {
+        Mesh::cacheEnabled() = false;
+        double parse_s = timeIt([&]() { Mesh mesh(path, nullptr); });
+        Mesh::cacheEnabled() = true;
+        remove((string(path) + ".meshcache").c_str());
+        double write_s = timeIt([&]() { Mesh mesh(path, nullptr); });
+        double cached_s = timeIt([&]() { Mesh mesh(path, nullptr); });
+        printf("  %-32s : parse %7.1f ms, parse + write cache %7.1f ms, cached %6.1f ms (%.1fx)\n",
+               path, parse_s * 1e3, write_s * 1e3, cached_s * 1e3, parse_s / cached_s);
+    }
+    Mesh::cacheEnabled() = false;
+}
+
+int main(int argc, char *argv[]) {
+    // the other benches measure the renderer, not the disk
+    Mesh::cacheEnabled() = false;
+    vector<pair<string, function<void()>>> benches = {
+        {"triangle", benchTriangle},
+        {"packets", benchPackets},
+        {"primary", benchPrimary},
+        {"occlusion", benchOcclusion},
+        {"meshload", benchMeshLoad},
+        {"objparse", benchObjParse},
+        {"shading", benchShading},
+        {"revsurface", benchRevSurface},
+        {"curve", benchCurve},
+        {"texture", benchTexture},
+    };
+    for (auto& bench : benches) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+            selected |= bench.first == argv[i];
+        if (selected)
+            bench.second();
+    }
+    return 0;
+}
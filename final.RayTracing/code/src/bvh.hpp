@@ -0,0 +1,263 @@
+#ifndef BVH_HPP_
+#define BVH_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "helpers.hpp"
+#include "aabb.hpp"
+#include "packet.hpp"
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+
+// Bounding volume hierarchy over a set of primitives, built with the binned
+// surface area heuristic. Nodes are stored depth first in one flat array:
+// the left child of an internal node directly follows it, the right child
+// is found at `offset`.
+struct BVH {
+    struct Node {
+        AABB box;
+        int offset; // leaf: first slot in indices; internal: right child
+        int count;  // number of primitives, 0 for internal nodes
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> indices; // primitive ids, grouped by leaf
+    int leaf_width;           // primitives tested at once in a leaf
+
+    BVH() : leaf_width(1) {}
+
+    // boxes[i] bounds primitive i. If leaves are intersected in groups of
+    // width primitives, the SAH charges every started group in full.
+    void build(const std::vector<AABB>& boxes, int width=1) {
+        leaf_width = width;
+        nodes.clear();
+        indices.resize(boxes.size());
+        for (int i = 0; i < (int) boxes.size(); i++) indices[i] = i;
+        if (boxes.empty()) return;
+
+        std::vector<Vec3> centroids(boxes.size());
+        for (int i = 0; i < (int) boxes.size(); i++)
+            centroids[i] = boxes[i].centroid();
+        nodes.reserve(2 * boxes.size());
+        buildNode(boxes, centroids, 0, boxes.size(), 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Visit the leaves hit by r in near-to-far order. For every primitive in
+    // a visited leaf, leaf_fn(prim, t_max) is called; it returns true on a
+    // hit and shrinks t_max, which prunes the remaining nodes.
+    // If any_hit is set, traversal stops at the first reported hit.
+    template <class LeafFn>
+    bool intersect(const Ray& r, double t_min, double t_max, LeafFn leaf_fn,
+                   bool any_hit=false, int* visited=nullptr) const {
+        return traverse(r, t_min, t_max, [&](int node_id, double& t) {
+            const Node& node = nodes[node_id];
+            bool hit = false;
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                if (leaf_fn(indices[i], t)) {
+                    hit = true;
+                    if (any_hit) break;
+                }
+            }
+            return hit;
+        }, any_hit, visited);
+    }
+
+    // Same as intersect, but leaf_fn(node_id, t_max) handles a whole leaf.
+    template <class LeafFn>
+    bool traverse(const Ray& r, double t_min, double t_max, LeafFn leaf_fn,
+                  bool any_hit=false, int* visited=nullptr) const {
+        if (nodes.empty()) return false;
+        Vec3 inv_d(1. / r.dir.x, 1. / r.dir.y, 1. / r.dir.z);
+        double t_entry;
+        if (!nodes[0].box.intersect(r.origin, inv_d, t_min, t_max, t_entry))
+            return false;
+
+        int stack[BVH_STACK_SIZE];
+        double stack_t[BVH_STACK_SIZE]; // entry distance of the stacked nodes
+        int sp = 0;
+        int cur = 0;
+        bool hit = false;
+        while (true) {
+            if (visited) (*visited)++;
+            const Node& node = nodes[cur];
+            if (node.count > 0) {
+                if (leaf_fn(cur, t_max)) {
+                    hit = true;
+                    if (any_hit) return true;
+                }
+            } else {
+                int left = cur + 1, right = node.offset;
+                double t_left, t_right;
+                bool hit_left = nodes[left].box.intersect(r.origin, inv_d, t_min, t_max, t_left);
+                bool hit_right = nodes[right].box.intersect(r.origin, inv_d, t_min, t_max, t_right);
+                if (hit_left && hit_right) {
+                    if (t_right < t_left) {
+                        std::swap(left, right);
+                        std::swap(t_left, t_right);
+                    }
+                    // visit the farther child later
+                    stack[sp] = right;
+                    stack_t[sp++] = t_right;
+                    cur = left;
+                    continue;
+                } else if (hit_left) {
+                    cur = left;
+                    continue;
+                } else if (hit_right) {
+                    cur = right;
+                    continue;
+                }
+            }
+            // skip stacked nodes that start behind the closest hit so far
+            do {
+                if (sp == 0) return hit;
+                cur = stack[--sp];
+            } while (stack_t[sp] > t_max);
+        }
+    }
+
+    // Visit the leaves entered by any ray of p in mask, each with the lanes
+    // that enter it, nearer leaves first along the packet's mean direction.
+    // leaf_fn(node_id, lanes) shrinks p.t_max of the lanes it hits; nodes
+    // are tested when visited, so the rest is pruned by the closest hits.
+    template <class LeafFn>
+    void traversePacket(const RayPacket& p, LaneMask mask, LeafFn leaf_fn) const {
+        if (nodes.empty() || !mask) return;
+        SimdLevel level = simd_level;
+        int stack[BVH_STACK_SIZE];
+        LaneMask stack_mask[BVH_STACK_SIZE];
+        int sp = 0;
+        stack[sp] = 0;
+        stack_mask[sp++] = mask;
+        while (sp > 0) {
+            int cur = stack[--sp];
+            const Node& node = nodes[cur];
+            LaneMask lanes = packetBox(node.box, p, stack_mask[sp], level);
+            if (!lanes)
+                continue;
+            if (node.count > 0) {
+                leaf_fn(cur, lanes);
+                continue;
+            }
+            int near = cur + 1, far = node.offset;
+            if ((nodes[near].box.centroid() - nodes[far].box.centroid()).dot(p.mean_dir) > 0)
+                std::swap(near, far);
+            stack[sp] = far;
+            stack_mask[sp++] = lanes;
+            stack[sp] = near;
+            stack_mask[sp++] = lanes;
+        }
+    }
+
+private:
+    struct Bin {
+        AABB box = AABB::empty();
+        int count = 0;
+    };
+
+    // create the node covering indices[begin..end), return its index
+    int buildNode(const std::vector<AABB>& boxes, const std::vector<Vec3>& centroids,
+                  int begin, int end, int depth) {
+        int id = nodes.size();
+        nodes.push_back(Node());
+        AABB box = AABB::empty(), centroid_box = AABB::empty();
+        for (int i = begin; i < end; i++) {
+            box.expand(boxes[indices[i]]);
+            centroid_box.expand(centroids[indices[i]]);
+        }
+        nodes[id].box = box;
+        int count = end - begin;
+
+        // pick the split with the lowest SAH cost over all three axes
+        Vec3 extent = centroid_box.box_h - centroid_box.box_l;
+        double best_cost = INFINITY;
+        int best_axis = -1, best_split = 0;
+        for (int axis = 0; axis < 3 && count > 2; axis++) {
+            double lo = axisOf(centroid_box.box_l, axis);
+            double len = axisOf(extent, axis);
+            if (len <= 0) continue;
+            Bin bins[BVH_BINS];
+            for (int i = begin; i < end; i++) {
+                int b = binOf(axisOf(centroids[indices[i]], axis), lo, len);
+                bins[b].count++;
+                bins[b].box.expand(boxes[indices[i]]);
+            }
+            // sweep from the right, then from the left
+            double right_area[BVH_BINS];
+            int right_count[BVH_BINS];
+            AABB acc = AABB::empty();
+            int n = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--) {
+                acc.expand(bins[b].box);
+                n += bins[b].count;
+                right_area[b] = acc.surfaceArea();
+                right_count[b] = n;
+            }
+            acc = AABB::empty();
+            n = 0;
+            for (int b = 0; b < BVH_BINS - 1; b++) {
+                acc.expand(bins[b].box);
+                n += bins[b].count;
+                if (n == 0 || right_count[b+1] == 0) continue;
+                double cost = acc.surfaceArea() * groups(n)
+                    + right_area[b+1] * groups(right_count[b+1]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b + 1;
+                }
+            }
+        }
+
+        // relative cost: one traversal step against intersecting every primitive
+        double leaf_cost = groups(count);
+        double area = box.surfaceArea();
+        if (best_axis >= 0 && area > 0)
+            best_cost = .125 + best_cost / area;
+
+        int mid;
+        if (depth >= BVH_STACK_SIZE / 2 && count > BVH_MAX_LEAF_SIZE) {
+            // keep the tree shallow enough for the traversal stack
+            mid = begin + count / 2;
+        } else if (best_axis >= 0 && (best_cost < leaf_cost || count > BVH_MAX_LEAF_SIZE)) {
+            double lo = axisOf(centroid_box.box_l, best_axis);
+            double len = axisOf(extent, best_axis);
+            int* p = std::partition(&indices[begin], &indices[0] + end, [&](int prim) {
+                return binOf(axisOf(centroids[prim], best_axis), lo, len) < best_split;
+            });
+            mid = p - &indices[0];
+        } else if (count > BVH_MAX_LEAF_SIZE) {
+            // centroids coincide, fall back to an even split
+            mid = begin + count / 2;
+        } else {
+            nodes[id].offset = begin;
+            nodes[id].count = count;
+            return id;
+        }
+
+        buildNode(boxes, centroids, begin, mid, depth + 1);
+        int right = buildNode(boxes, centroids, mid, end, depth + 1);
+        nodes[id].offset = right;
+        nodes[id].count = 0;
+        return id;
+    }
+
+    int groups(int count) const {
+        return (count + leaf_width - 1) / leaf_width;
+    }
+
+    static double axisOf(const Vec3& v, int axis) {
+        return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+    }
+
+    static int binOf(double c, double lo, double len) {
+        int b = (int) ((c - lo) / len * BVH_BINS);
+        return b < 0 ? 0 : b >= BVH_BINS ? BVH_BINS - 1 : b;
+    }
+};
+
+#endif // BVH_HPP_
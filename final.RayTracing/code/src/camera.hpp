@@ -28,7 +28,11 @@ struct Camera {
     }
 
     // Generate rays for each screen-space coordinate
-    virtual Ray generateRay(const Vec3 &point, unsigned short* Xi) = 0;
+    virtual Ray generateRay(const Vec3 &point, Sampler &sampler) = 0;
+    // The same ray with its neighbours one pixel over, if the camera can tell
+    virtual RayDifferential generateRayDifferential(const Vec3 &point, Sampler &sampler) {
+        return generateRay(point, sampler);
+    }
     // virtual void renderFrame(const SceneParser& sp, Image& outImg, int n_samples) = 0;
     virtual ~Camera() = default;
 };
@@ -47,7 +51,7 @@ struct PerspectiveCamera : public Camera {
             - this->horizontal * width / 2 - this->up * height / 2;
     }
 
-    Ray generateRay(const Vec3 &point, unsigned short* Xi) override {
+    Ray generateRay(const Vec3 &point, Sampler &sampler) override {
         // Vec3 d_rc(point.x-width/2+1, point.y-height/2+1, distToCanvas);
         // d_rc.normalize();
         // Mat44 R(horizontal, up, direction);
@@ -55,6 +59,15 @@ struct PerspectiveCamera : public Camera {
         auto dir = bottomLeft + horizontal * point.x + up * point.y - center;
         return Ray(center, dir.normalized());
     }
+
+    RayDifferential generateRayDifferential(const Vec3 &point, Sampler &sampler) override {
+        RayDifferential r = PerspectiveCamera::generateRay(point, sampler);
+        r.rx_origin = r.ry_origin = center;
+        r.rx_dir = (bottomLeft + horizontal * (point.x + 1) + up * point.y - center).normalized();
+        r.ry_dir = (bottomLeft + horizontal * point.x + up * (point.y + 1) - center).normalized();
+        r.has_differentials = true;
+        return r;
+    }
 };
 
 struct DoFCamera : public PerspectiveCamera {
@@ -74,14 +87,30 @@ struct DoFCamera : public PerspectiveCamera {
         focus_to_canvas_ratio = focusDist / distToCanvas;
     }
 
-    Ray generateRay(const Vec3& point, unsigned short* Xi) override {
-        auto dir_to_canvas = bottomLeft + horizontal * point.x + up * point.y - center;
-        auto dir_to_focus_plane = dir_to_canvas * focus_to_canvas_ratio;
-        auto point_on_focus_plane = center + dir_to_focus_plane;
+    Ray generateRay(const Vec3& point, Sampler &sampler) override {
+        auto point_on_focus_plane = focusPoint(point);
 
-        auto rd = Vec3::random_in_unit_disk(Xi) * lens_radius;
+        auto rd = Vec3::random_in_unit_disk(sampler.get2D()) * lens_radius;
         auto new_center = center + horizontal * rd.x + up * rd.y;
         return Ray(new_center, (point_on_focus_plane - new_center).normalized());
     }
+
+    // the neighbours leave from the same point of the lens, and meet the
+    // ray's own neighbours on the focus plane
+    RayDifferential generateRayDifferential(const Vec3 &point, Sampler &sampler) override {
+        RayDifferential r = DoFCamera::generateRay(point, sampler);
+        r.rx_origin = r.ry_origin = r.origin;
+        r.rx_dir = (focusPoint(point + Vec3(1, 0)) - r.origin).normalized();
+        r.ry_dir = (focusPoint(point + Vec3(0, 1)) - r.origin).normalized();
+        r.has_differentials = true;
+        return r;
+    }
+
+private:
+    // where the ray through point of the canvas is in focus
+    Vec3 focusPoint(const Vec3 &point) const {
+        auto dir_to_canvas = bottomLeft + horizontal * point.x + up * point.y - center;
+        return center + dir_to_canvas * focus_to_canvas_ratio;
+    }
 };
 #endif //CAMERA_H
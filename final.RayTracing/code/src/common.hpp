@@ -2,6 +2,7 @@
 #define COMMON_HPP_
 
 #include <bits/stdc++.h>
+#include <unistd.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -24,5 +25,17 @@ inline unsigned char gamma_trans(double x) {
 
 inline double square(double x) { return x * x; }
 
+// A name next to path to write it under before renaming it into place,
+// unique to the process and the call so that writers running at the same
+// time never share one. The extension stays last.
+inline std::string tempPath(const std::string& path) {
+    static std::atomic<int> calls(0);
+    std::string tag = ".tmp" + std::to_string(getpid()) + "_" + std::to_string(calls++);
+    size_t dot = path.rfind('.'), slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + tag;
+    return path.substr(0, dot) + tag + path.substr(dot);
+}
+
 
 #endif
\ No newline at end of file
@@ -22,26 +22,23 @@ public:
         return v0;
     }
 
+    // last knot below mu, or at mu for the first knot
     int get_bpos(double mu) const
     {
         if (mu < t[0] || t.back() < mu) {
             return -1;
         }
         if (mu == t[0]) {
-            for (auto bpos = t.size() - 1; bpos >= 0; bpos--) {
-                if (t[bpos] <= mu) {
-                    return bpos;
-                }
-            }
-        } else {
-            for (auto bpos = t.size() - 1; bpos >= 0; bpos--) {
-                if (t[bpos] < mu) {
-                    return bpos;
-                }
-            }
+            return std::upper_bound(t.begin(), t.end(), mu) - t.begin() - 1;
         }
+        return std::lower_bound(t.begin(), t.end(), mu) - t.begin() - 1;
     }
 
+    int order() const { return k + 1; }
+    const std::vector<double>& knots() const { return t; }
+    const std::vector<double>& padded_knots() const { return tpad; }
+    int control_count() const { return n; }
+
     std::pair<double, double> get_valid_range() const
     {
         return std::make_pair(t[k], t[t.size()-k-1]);
@@ -104,6 +101,214 @@ private:
     std::vector<double> tpad;
 };
 
+// Position and derivative of a polynomial of degree K with coefficients
+// c[0..K], by Horner's rule unrolled at compile time
+template <int K>
+struct CurveEvaluator {
+    static void evaluate(const Vec3* c, double x, Vec3& p, Vec3& dp) {
+        CurveEvaluator<K - 1>::evaluate(c + 1, x, p, dp);
+        dp = dp * x + p;
+        p = p * x + c[0];
+    }
+
+    // the same with the second derivative
+    static void evaluate(const Vec3* c, double x, Vec3& p, Vec3& dp, Vec3& ddp) {
+        CurveEvaluator<K - 1>::evaluate(c + 1, x, p, dp, ddp);
+        ddp = ddp * x + dp * 2;
+        dp = dp * x + p;
+        p = p * x + c[0];
+    }
+};
+
+template <>
+struct CurveEvaluator<0> {
+    static void evaluate(const Vec3* c, double, Vec3& p, Vec3& dp) {
+        p = c[0];
+        dp = Vec3();
+    }
+
+    static void evaluate(const Vec3* c, double, Vec3& p, Vec3& dp, Vec3& ddp) {
+        p = c[0];
+        dp = ddp = Vec3();
+    }
+};
+
+// Closed interval [lo, hi] with the arithmetic needed to bound curves and
+// the functions of them the intersectors solve
+struct Interval {
+    double lo, hi;
+
+    Interval(double v=0) : lo(v), hi(v) {}
+    Interval(double lo_, double hi_) : lo(lo_), hi(hi_) {}
+
+    Interval operator+(const Interval& o) const { return Interval(lo + o.lo, hi + o.hi); }
+    Interval operator-(const Interval& o) const { return Interval(lo - o.hi, hi - o.lo); }
+    Interval operator*(const Interval& o) const {
+        double a = lo * o.lo, b = lo * o.hi, c = hi * o.lo, d = hi * o.hi;
+        return Interval(std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d)));
+    }
+    Interval operator*(double k) const { return k >= 0 ? Interval(lo * k, hi * k) : Interval(hi * k, lo * k); }
+
+    Interval square() const {
+        if (lo >= 0)
+            return Interval(lo * lo, hi * hi);
+        if (hi <= 0)
+            return Interval(hi * hi, lo * lo);
+        return Interval(0, std::max(lo * lo, hi * hi));
+    }
+
+    bool contains(double v) const { return lo <= v && v <= hi; }
+};
+
+// A curve in power basis form: on span j it is the polynomial with
+// coefficients coef[j * order ..] in x = mu - start[j]. Built once from the
+// knots; evaluating needs no allocation, a binary search for the span (or
+// a division if the spans are uniform) and Horner's rule.
+class PowerBasisCurve {
+public:
+    PowerBasisCurve() : order(0), uniform_inv(0) {}
+
+    void build(const Bernstein& bern, const std::vector<Vec3>& controls) {
+        const std::vector<double>& t = bern.padded_knots();
+        int k = bern.order() - 1, n = bern.control_count();
+        auto range = bern.get_valid_range();
+        order = k + 1;
+        start.clear();
+        coef.clear();
+        int first = bern.get_bpos(range.first), last = bern.get_bpos(range.second);
+        for (int j = first; j <= last; j++) {
+            if (t[j + 1] <= t[j])
+                continue; // empty span
+            // basis polynomials N[i - (j - k)] of degree p on span j, by the
+            // Cox-de Boor recurrence on their coefficients
+            std::vector<std::vector<double>> basis(k + 2, std::vector<double>(order, 0.));
+            basis[k][0] = 1;
+            for (int p = 1; p <= k; p++) {
+                for (int r = 0; r <= k; r++) {
+                    int i = j - k + r;
+                    std::vector<double> next(order, 0.);
+                    // (u - t_i) / (t_i+p - t_i) * N_i,p-1, with u = x + t_j
+                    double w = t[i + p] - t[i];
+                    if (w > 0) {
+                        for (int e = order - 1; e >= 0; e--)
+                            next[e] += ((e > 0 ? basis[r][e - 1] : 0) + (t[j] - t[i]) * basis[r][e]) / w;
+                    }
+                    // (t_i+p+1 - u) / (t_i+p+1 - t_i+1) * N_i+1,p-1
+                    w = t[i + p + 1] - t[i + 1];
+                    if (w > 0) {
+                        for (int e = order - 1; e >= 0; e--)
+                            next[e] += ((t[i + p + 1] - t[j]) * basis[r + 1][e] - (e > 0 ? basis[r + 1][e - 1] : 0)) / w;
+                    }
+                    basis[r] = next;
+                }
+            }
+            start.push_back(t[j]);
+            for (int e = 0; e < order; e++) {
+                Vec3 c;
+                for (int r = 0; r <= k; r++) {
+                    int i = j - k + r;
+                    if (i >= 0 && i < n)
+                        c += controls[i] * basis[r][e];
+                }
+                coef.push_back(c);
+            }
+        }
+        start.push_back(range.second);
+        // spans of equal length are found without searching
+        double width = start.size() > 1 ? (start.back() - start[0]) / (start.size() - 1) : 0;
+        uniform_inv = width > 0 ? 1 / width : 0;
+        for (int j = 0; j + 1 < (int) start.size() && uniform_inv > 0; j++)
+            if (fabs(start[j + 1] - start[j] - width) > 1e-12 * width)
+                uniform_inv = 0;
+    }
+
+    bool empty() const { return coef.empty(); }
+
+    int span(double mu) const {
+        int spans = start.size() - 1;
+        int j = uniform_inv > 0 ? (int) ((mu - start[0]) * uniform_inv)
+                                : std::upper_bound(start.begin(), start.end(), mu) - start.begin() - 1;
+        return std::max(0, std::min(j, spans - 1));
+    }
+
+    // position and derivative at mu. Cubics, all our B-splines, take the
+    // unrolled evaluator. The order is fixed when the curve is built, so the
+    // branch always goes the same way; a function pointer would keep this
+    // from being inlined, which costs more than the loop saves.
+    void evaluate(double mu, Vec3& p, Vec3& dp) const {
+        int j = span(mu);
+        const Vec3* c = &coef[j * order];
+        if (order == 4)
+            CurveEvaluator<3>::evaluate(c, mu - start[j], p, dp);
+        else
+            horner(c, mu - start[j], p, dp);
+    }
+
+    // the same with the loop for any degree
+    void evaluateGeneric(double mu, Vec3& p, Vec3& dp) const {
+        int j = span(mu);
+        horner(&coef[j * order], mu - start[j], p, dp);
+    }
+
+    // Bounds of x and y of the position and the derivative over [lo, hi],
+    // by Horner's rule in interval arithmetic on each span it covers
+    void bound(double lo, double hi, Interval p[2], Interval dp[2]) const {
+        double Vec3::* axes[] = {&Vec3::x, &Vec3::y};
+        for (int j = span(lo), last = span(hi); j <= last; j++) {
+            const Vec3* c = &coef[j * order];
+            Interval x(std::max(lo, start[j]) - start[j], std::min(hi, start[j + 1]) - start[j]);
+            if (j == last && x.hi < x.lo)
+                x.hi = x.lo; // hi past the end of the curve
+            for (int a = 0; a < 2; a++) {
+                Interval q(c[order - 1].*axes[a]), dq(0);
+                for (int e = order - 2; e >= 0; e--) {
+                    dq = dq * x + q;
+                    q = q * x + Interval(c[e].*axes[a]);
+                }
+                if (j == span(lo)) {
+                    p[a] = q, dp[a] = dq;
+                } else {
+                    p[a] = Interval(std::min(p[a].lo, q.lo), std::max(p[a].hi, q.hi));
+                    dp[a] = Interval(std::min(dp[a].lo, dq.lo), std::max(dp[a].hi, dq.hi));
+                }
+            }
+        }
+    }
+
+    // position and first two derivatives at mu, unrolled for cubics too
+    void evaluate(double mu, Vec3& p, Vec3& dp, Vec3& ddp) const {
+        int j = span(mu);
+        const Vec3* c = &coef[j * order];
+        double x = mu - start[j];
+        if (order == 4) {
+            CurveEvaluator<3>::evaluate(c, x, p, dp, ddp);
+            return;
+        }
+        p = c[order - 1];
+        dp = ddp = Vec3();
+        for (int e = order - 2; e >= 0; e--) {
+            ddp = ddp * x + dp * 2;
+            dp = dp * x + p;
+            p = p * x + c[e];
+        }
+    }
+
+private:
+    void horner(const Vec3* c, double x, Vec3& p, Vec3& dp) const {
+        p = c[order - 1];
+        dp = Vec3();
+        for (int e = order - 2; e >= 0; e--) {
+            dp = dp * x + p;
+            p = p * x + c[e];
+        }
+    }
+
+    int order;
+    double uniform_inv;        // 1 / span length if all spans are as long, else 0
+    std::vector<double> start; // first knot of every span, then the end
+    std::vector<Vec3> coef;
+};
+
 // The CurvePoint object stores information about a point on a curve
 // after it has been tesselated: the vertex (V) and the tangent (T)
 // It is the responsiblility of functions that create these objects to fill in all the data.
@@ -149,7 +354,17 @@ public:
 
     std::pair<double, double> get_valid_range() { return bern->get_valid_range(); }
 
-    virtual std::pair<Vec3, Vec3> evaluate(double ti) = 0;
+    // returns vertex and tangent, from the power basis form
+    std::pair<Vec3, Vec3> evaluate(double ti) const {
+        std::pair<Vec3, Vec3> result;
+        power.evaluate(ti, result.first, result.second);
+        return result;
+    }
+
+    const PowerBasisCurve& powerBasis() const { return power; }
+
+protected:
+    PowerBasisCurve power;
 };
 
 class BezierCurve : public Curve {
@@ -163,6 +378,7 @@ public:
         }
         // auto knots = Bernstein::bezier_knot(n-1);
         bern = new Bernstein(n, n-1, Bernstein::bezier_knot(n-1));
+        power.build(*bern, controls);
     }
 
     void discretize(int resolution, std::vector<CurvePoint>& data) override {
@@ -179,9 +395,6 @@ public:
         }
     }
 
-    std::pair<Vec3, Vec3> evaluate(double ti) {
-        return Curve::evaluate(*bern, ti);
-    }
 };
 
 class BsplineCurve : public Curve {
@@ -201,6 +414,7 @@ public:
                 knots[i] = i * 1.0 / (n+k+1);
             }
             bern = new Bernstein(n, k, knots);
+            power.build(*bern, controls);
     }
 
     void discretize(int resolution, std::vector<CurvePoint>& data) override {
@@ -214,9 +428,6 @@ public:
         }
     }
 
-    std::pair<Vec3, Vec3> evaluate(double ti) {
-        return Curve::evaluate(*bern, ti);
-    }
 };
 
 #endif // CURVE_HPP
@@ -0,0 +1,252 @@
+#ifndef FILM_HPP_
+#define FILM_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "image.hpp"
+
+#define FILM_CHECKPOINT_MAGIC 0x54504b43 // "CKPT"
+#define FILM_CHECKPOINT_VERSION 4
+#define HALF_TILED_MAGIC 0x4c495448 // "HTIL"
+#define HALF_TILED_TILE 32
+
+// What a checkpoint must agree on to be resumed. The samplers are counter
+// based, so the sample count is all the random state there is.
+struct FilmSettings {
+    int scene;
+    int samps; // target samples per subpixel
+    int sampler;
+    int max_depth;
+    int rr_depth;
+    int nee;
+    int sample_offset;
+    int tile_index, tile_count;
+    int sample_total; // --sample-total, which the sampler is built for, 0 if not given
+    int tile_size;    // which with tile_count decides the tiles of a part
+
+    // whether films with these settings show the same picture with the same
+    // samples, so that they can be merged. The tile size only matters once
+    // the tiles are split into parts.
+    bool sameImage(const FilmSettings& o) const {
+        return scene == o.scene && sampler == o.sampler && max_depth == o.max_depth
+            && rr_depth == o.rr_depth && nee == o.nee && sample_total == o.sample_total
+            && ((tile_count == 1 && o.tile_count == 1) || tile_size == o.tile_size);
+    }
+
+    bool operator==(const FilmSettings& o) const {
+        return sameImage(o) && samps == o.samps && sample_offset == o.sample_offset
+            && tile_index == o.tile_index && tile_count == o.tile_count;
+    }
+};
+
+// IEEE 754 half precision from a float, rounding to nearest even
+inline uint16_t floatToHalf(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint16_t sign = (x >> 16) & 0x8000;
+    int exp = (x >> 23) & 0xff;
+    uint32_t mant = x & 0x7fffff;
+    if (exp == 0xff) // inf and nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    int e = exp - 127 + 15;
+    if (e >= 0x1f) // overflow
+        return sign | 0x7c00;
+    if (e <= 0) { // subnormal or zero
+        if (e < -10)
+            return sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    uint32_t half = (e << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++; // may carry into the exponent, which is still correct
+    return sign | half;
+}
+
+// Unclamped linear radiance of a frame: the float sum of all samples that
+// landed in every pixel, and how many there were. Films of the same frame
+// are merged by adding both.
+struct Film {
+    int width, height; // in pixels
+    int samples;       // per subpixel, for progressive passes
+    std::vector<float> rgb;   // 3 sums per pixel, rows from the bottom
+    std::vector<float> count; // samples per pixel
+
+    Film(int w, int h) : width(w), height(h), samples(0), rgb(3 * w * h), count(w * h) {}
+
+    void add(int x, int y, const Vec3& c) {
+        int i = y * width + x;
+        rgb[3 * i] += c.x;
+        rgb[3 * i + 1] += c.y;
+        rgb[3 * i + 2] += c.z;
+        count[i] += 1;
+    }
+
+    // Add the samples of other, a film of the same frame. Parts rendered
+    // with other tiles or sample ranges are combined weighted by their counts.
+    void merge(const Film& other) {
+        for (size_t i = 0; i < rgb.size(); i++)
+            rgb[i] += other.rgb[i];
+        for (size_t i = 0; i < count.size(); i++)
+            count[i] += other.count[i];
+    }
+
+    // mean radiance of a pixel
+    Vec3 pixel(int x, int y) const {
+        int i = y * width + x;
+        if (count[i] == 0)
+            return Vec3();
+        return Vec3(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]) / count[i];
+    }
+
+    void resolve(Image& img) const {
+        img.SetSize(width, height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                img.SetPixel(x, y, pixel(x, y));
+    }
+
+    // Portable float map of the mean radiance, three channels, little endian
+    bool savePFM(const std::string& path) const {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+        std::vector<float> row(3 * width);
+        bool ok = true;
+        // PFM also stores the bottom row first
+        for (int y = 0; y < height && ok; y++) {
+            for (int x = 0; x < width; x++) {
+                Vec3 c = pixel(x, y);
+                row[3 * x] = c.x, row[3 * x + 1] = c.y, row[3 * x + 2] = c.z;
+            }
+            ok = fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+        }
+        return fclose(file) == 0 && ok;
+    }
+
+    // Half float tiles, for smaller files that can be read a region at a
+    // time. Header: magic, width, height, tile size (int32 each). Then the
+    // tiles row by row from the bottom left, each with its mean R, G and B
+    // planes as halves followed by the sample counts as floats. Edge tiles
+    // only store the pixels inside the frame.
+    bool saveHalfTiled(const std::string& path) const {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        int header[] = {HALF_TILED_MAGIC, width, height, HALF_TILED_TILE};
+        bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+        std::vector<uint16_t> planes;
+        std::vector<float> counts;
+        for (int ty = 0; ty < height && ok; ty += HALF_TILED_TILE) {
+            for (int tx = 0; tx < width && ok; tx += HALF_TILED_TILE) {
+                int x1 = std::min(width, tx + HALF_TILED_TILE), y1 = std::min(height, ty + HALF_TILED_TILE);
+                int n = (x1 - tx) * (y1 - ty);
+                planes.assign(3 * n, 0);
+                counts.clear();
+                int k = 0;
+                for (int y = ty; y < y1; y++) {
+                    for (int x = tx; x < x1; x++, k++) {
+                        Vec3 c = pixel(x, y);
+                        planes[k] = floatToHalf(c.x);
+                        planes[n + k] = floatToHalf(c.y);
+                        planes[2 * n + k] = floatToHalf(c.z);
+                        counts.push_back(count[y * width + x]);
+                    }
+                }
+                ok = fwrite(planes.data(), sizeof(uint16_t), planes.size(), file) == planes.size()
+                    && fwrite(counts.data(), sizeof(float), counts.size(), file) == counts.size();
+            }
+        }
+        return fclose(file) == 0 && ok;
+    }
+
+    // PFM for .pfm, half float tiles for .htf
+    bool saveHDR(const std::string& path) const {
+        size_t len = path.size();
+        if (len > 4 && path.compare(len - 4, 4, ".htf") == 0)
+            return saveHalfTiled(path);
+        return savePFM(path);
+    }
+
+    // Write to a temporary file first and rename it over path, so that a
+    // crash never leaves a half written checkpoint behind.
+    bool saveCheckpoint(const std::string& path, const FilmSettings& settings) const {
+        std::string tmp = tempPath(path);
+        FILE* file = fopen(tmp.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        int header[] = {FILM_CHECKPOINT_MAGIC, FILM_CHECKPOINT_VERSION, width, height, samples};
+        bool ok = fwrite(header, sizeof(header), 1, file) == 1
+            && fwrite(&settings, sizeof(settings), 1, file) == 1
+            && fwrite(rgb.data(), sizeof(float), rgb.size(), file) == rgb.size()
+            && fwrite(count.data(), sizeof(float), count.size(), file) == count.size();
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Load a film saved by saveCheckpoint, whatever its size, and the
+    // settings it was rendered with.
+    bool load(const std::string& path, FilmSettings& settings) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            printf("Cannot open %s\n", path.c_str());
+            return false;
+        }
+        int header[5];
+        bool ok = fread(header, sizeof(header), 1, file) == 1
+            && fread(&settings, sizeof(settings), 1, file) == 1;
+        if (!ok || header[0] != FILM_CHECKPOINT_MAGIC || header[1] != FILM_CHECKPOINT_VERSION
+            || header[2] <= 0 || header[3] <= 0) {
+            printf("%s is not a film\n", path.c_str());
+            ok = false;
+        } else {
+            *this = Film(header[2], header[3]);
+            ok = fread(rgb.data(), sizeof(float), rgb.size(), file) == rgb.size()
+                && fread(count.data(), sizeof(float), count.size(), file) == count.size();
+            samples = header[4];
+            if (!ok)
+                printf("%s is truncated\n", path.c_str());
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // Load a checkpoint of a frame of the same size and settings.
+    bool loadCheckpoint(const std::string& path, const FilmSettings& settings) {
+        Film saved(width, height);
+        FilmSettings saved_settings;
+        if (!saved.load(path, saved_settings))
+            return false;
+        if (saved.width != width || saved.height != height || !(saved_settings == settings)) {
+            printf("Checkpoint %s was rendered with other settings\n", path.c_str());
+            return false;
+        }
+        *this = std::move(saved);
+        return true;
+    }
+};
+
+// Save img to path through a temporary file, so that viewers never see a
+// partial image.
+inline bool saveImageAtomic(Image& img, const std::string& path) {
+    std::string tmp = tempPath(path);
+    img.SaveImage(tmp.c_str());
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif // FILM_HPP_
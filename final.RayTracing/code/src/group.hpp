@@ -3,6 +3,7 @@
 
 #include "object3d.hpp"
 #include "helpers.hpp"
+#include "bvh.hpp"
 
 #include <iostream>
 #include <vector>
@@ -10,8 +11,14 @@
 class Group : public Object3D {
 public:
     std::vector<Object3D*> objects;
+    // after build(): objects with finite bounds live in the BVH,
+    // the rest (e.g. infinite planes) are tested one by one
+    std::vector<Object3D*> bounded;
+    std::vector<Object3D*> unbounded;
+    BVH bvh;
+    bool built;
 
-    Group() {}
+    Group() : built(false) {}
 
     ~Group() override {
         for (auto obj: objects) {
@@ -20,23 +27,116 @@ public:
     }
 
     bool intersect(const Ray &r, Hit &h, double tmin) override {
-        // intersect every object in objects
-        // find the closest and return
-        bool hasIntersect = false;
+        if (!built)
+            return intersectAll(objects, r, h, tmin);
+        bool hasIntersect = intersectAll(unbounded, r, h, tmin);
         Hit h_tmp;
+        hasIntersect |= bvh.intersect(r, tmin, h.t, [&](int i, double &tmax) {
+            if (bounded[i]->intersect(r, h_tmp, tmin) && h_tmp.t < tmax) {
+                tmax = h_tmp.t;
+                h = h_tmp;
+                h.object = bounded[i];
+                return true;
+            }
+            return false;
+        });
+        return hasIntersect;
+    }
+
+    // the packet goes down the top-level BVH, and down the children's own
+    LaneMask intersectPacket(RayPacket &p, LaneMask mask) override {
+        LaneMask hit = 0;
+        auto visit = [&](Object3D *obj, LaneMask lanes) {
+            LaneMask closer = obj->intersectPacket(p, lanes);
+            forEachLane(closer, [&](int i) { p.hits[i].object = obj; });
+            hit |= closer;
+        };
+        if (!built) {
+            for (auto obj : objects)
+                visit(obj, mask);
+            return hit;
+        }
+        for (auto obj : unbounded)
+            visit(obj, mask);
+        bvh.traversePacket(p, mask, [&](int node_id, LaneMask lanes) {
+            const BVH::Node& node = bvh.nodes[node_id];
+            for (int k = node.offset; k < node.offset + node.count; k++)
+                visit(bounded[bvh.indices[k]], lanes);
+        });
+        return hit;
+    }
+
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        if (!built)
+            return occludedAny(objects, r, tmin, tmax);
+        if (occludedAny(unbounded, r, tmin, tmax))
+            return true;
+        return bvh.intersect(r, tmin, tmax, [&](int i, double &) {
+            return bounded[i]->occluded(r, tmin, tmax);
+        }, true);
+    }
+
+    // Build the top-level BVH over the children's world-space bounds.
+    // Must be called again after adding objects.
+    void build() {
+        bounded.clear();
+        unbounded.clear();
+        std::vector<AABB> boxes;
         for (auto obj: objects) {
+            AABB box;
+            if (obj->getBounds(box)) {
+                bounded.push_back(obj);
+                boxes.push_back(box);
+            } else {
+                unbounded.push_back(obj);
+            }
+        }
+        bvh.build(boxes);
+        built = true;
+    }
+
+    bool getBounds(AABB &box) override {
+        box = AABB::empty();
+        for (auto obj: objects) {
+            AABB b;
+            if (!obj->getBounds(b))
+                return false;
+            box.expand(b);
+        }
+        return !objects.empty();
+    }
+
+    void addObject(Object3D *obj) {
+        objects.push_back(obj);
+        built = false;
+    }
+
+   int getGroupSize() { return objects.size(); }
+
+private:
+    // intersect every object in objs, find the closest and return
+    static bool intersectAll(const std::vector<Object3D*> &objs,
+                             const Ray &r, Hit &h, double tmin) {
+        bool hasIntersect = false;
+        Hit h_tmp;
+        for (auto obj: objs) {
             if (obj->intersect(r, h_tmp, tmin) && h_tmp.t < h.t) {
                 h = h_tmp;
+                h.object = obj;
                 hasIntersect = true;
             }
         }
         return hasIntersect;
     }
 
-    void addObject(Object3D *obj) { objects.push_back(obj); }
-
-   int getGroupSize() { return objects.size(); }
+    static bool occludedAny(const std::vector<Object3D*> &objs,
+                            const Ray &r, double tmin, double tmax) {
+        for (auto obj: objs) {
+            if (obj->occluded(r, tmin, tmax))
+                return true;
+        }
+        return false;
+    }
 };
 
 #endif
-	
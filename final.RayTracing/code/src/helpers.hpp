@@ -1,15 +1,13 @@
 #ifndef HELPERS_H_
 #define HELPERS_H_
 
-#ifndef STB_IMAGE_IMPLEMENTATION
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-#endif
-
 #include "common.hpp"
 #include "vec.hpp"
+#include "sampler.hpp"
+#include "texture.hpp"
 
 class Material;
+class Object3D;
 
 // Ray class mostly copied from Peter Shirley and Keith Morley
 class Ray {
@@ -28,31 +26,111 @@ inline std::ostream &operator<<(std::ostream &os, const Ray &r) {
     return os;
 }
 
-// TODO: add u,v for texture mapping here
+// A ray with two neighbours, offset by one pixel in x and y, that tell how
+// large the footprint of a pixel is wherever the ray hits.
+class RayDifferential : public Ray {
+public:
+    bool has_differentials;
+    Vec3 rx_origin, rx_dir;
+    Vec3 ry_origin, ry_dir;
+
+    RayDifferential(const Ray &r) : Ray(r), has_differentials(false) {}
+    RayDifferential(const Vec3 &orig, const Vec3 &_dir) : Ray(orig, _dir), has_differentials(false) {}
+
+    // shrink the offsets to s pixels
+    void scaleDifferentials(double s) {
+        rx_origin = origin + (rx_origin - origin) * s;
+        ry_origin = origin + (ry_origin - origin) * s;
+        rx_dir = dir + (rx_dir - dir) * s;
+        ry_dir = dir + (ry_dir - dir) * s;
+    }
+};
+
 class Hit {
 public:
     double t;
     Material *material;
     Vec3 normal;
     Vec3 uv;
+    Vec3 dpdu, dpdv;   // change of the hit point with uv, zero without uv
+    Vec3 dndu, dndv;   // change of the normal with uv, zero where it is flat
+    Vec3 duvdx, duvdy; // change of uv from one pixel to the next
+    Vec3 dpdx, dpdy;   // change of the hit point from one pixel to the next
+    bool has_differentials; // dpdx and dpdy are known
+    Object3D *object; // top level object that was hit, set by Group
 
-    Hit() : material(nullptr), t(1e38) {}
+    Hit() : material(nullptr), t(1e38), has_differentials(false), object(nullptr) {}
 
     Hit(double _t, Material *m, const Vec3 &n, const Vec3& uv_=Vec3()) :
-        t(_t), material(m), normal(n), uv(uv_) {}
+        t(_t), material(m), normal(n), uv(uv_), has_differentials(false), object(nullptr) {}
 
     Hit(const Hit &h) {
         t = h.t;
         material = h.material;
         normal = h.normal;
         uv = h.uv;
+        dpdu = h.dpdu;
+        dpdv = h.dpdv;
+        dndu = h.dndu;
+        dndv = h.dndv;
+        duvdx = h.duvdx;
+        duvdy = h.duvdy;
+        dpdx = h.dpdx;
+        dpdy = h.dpdy;
+        has_differentials = h.has_differentials;
+        object = h.object;
     }
 
-    void set(double _t, Material *_m, const Vec3 &n, const Vec3& uv_=Vec3()) {
+    void set(double _t, Material *_m, const Vec3 &n, const Vec3& uv_=Vec3(),
+             const Vec3& dpdu_=Vec3(), const Vec3& dpdv_=Vec3(),
+             const Vec3& dndu_=Vec3(), const Vec3& dndv_=Vec3()) {
         t = _t;
         material = _m;
         normal = n;
         uv = uv_;
+        dpdu = dpdu_;
+        dpdv = dpdv_;
+        dndu = dndu_;
+        dndv = dndv_;
+    }
+
+    // Find dpdx and dpdy from where the neighbours of r meet the tangent
+    // plane of the hit, and from them duvdx and duvdy; all zero if r has no
+    // neighbours, and the uv ones also if the hit has no uv.
+    void computeDifferentials(const RayDifferential &r) {
+        duvdx = duvdy = dpdx = dpdy = Vec3();
+        has_differentials = false;
+        if (!r.has_differentials)
+            return;
+        Vec3 p = r.pointAtParameter(t);
+        double d = normal.dot(p);
+        double mx = normal.dot(r.rx_dir), my = normal.dot(r.ry_dir);
+        if (mx == 0 || my == 0)
+            return;
+        dpdx = r.rx_origin + r.rx_dir * ((d - normal.dot(r.rx_origin)) / mx) - p;
+        dpdy = r.ry_origin + r.ry_dir * ((d - normal.dot(r.ry_origin)) / my) - p;
+        has_differentials = true;
+        if (dpdu.len2() == 0 || dpdv.len2() == 0)
+            return;
+        // solve dp = dpdu du + dpdv dv in the two axes the normal is
+        // least aligned with
+        Vec3 a(fabs(normal.x), fabs(normal.y), fabs(normal.z));
+        int i0 = 1, i1 = 2;
+        if (a.y > a.x && a.y > a.z)
+            i0 = 0;
+        else if (a.z > a.x)
+            i0 = 0, i1 = 1;
+        auto comp = [](const Vec3 &v, int i) { return i == 0 ? v.x : i == 1 ? v.y : v.z; };
+        double a00 = comp(dpdu, i0), a01 = comp(dpdv, i0), a10 = comp(dpdu, i1), a11 = comp(dpdv, i1);
+        double det = a00 * a11 - a01 * a10;
+        if (fabs(det) < 1e-12 * dpdu.len() * dpdv.len())
+            return;
+        auto solve = [&](const Vec3 &dp) {
+            double b0 = comp(dp, i0), b1 = comp(dp, i1);
+            return Vec3((a11 * b0 - a01 * b1) / det, (a00 * b1 - a10 * b0) / det);
+        };
+        duvdx = solve(dpdx);
+        duvdy = solve(dpdy);
     }
 };
 
@@ -68,26 +146,17 @@ public:
     Vec3 emission;
     double n_material; // refraction index
 
-    unsigned char* texture_buf;
-    int w, h, _c;
+    TextureHandle texture; // shared through the texture cache, read when first sampled
 
     Material(MaterialType t, const Vec3 &c, const Vec3 &e=Vec3(),
-        double n=1., const std::string& texture="") :
-            type(t), color(c), emission(e), n_material(n), texture_buf(nullptr) {
-                if (texture != "") {
-                    texture_buf = stbi_load(texture.c_str(), &w, &h, &_c, 0);
+        double n=1., const std::string& texture_path="") :
+            type(t), color(c), emission(e), n_material(n) {
+                if (texture_path != "") {
+                    texture = TextureCache::instance().get(texture_path);
                 }
             }
 
-    Material(const Material& m): type(m.type), color(m.color), emission(m.emission),
-        n_material(m.n_material), w(m.w), h(m.h), _c(m._c), texture_buf(nullptr) {
-            if (m.texture_buf != nullptr) {
-                texture_buf = new unsigned char[sizeof(m.texture_buf) / sizeof(unsigned char)];
-                memcpy(texture_buf, m.texture_buf, sizeof(m.texture_buf));
-            }
-        }
-
-    virtual ~Material() = default;
+    virtual ~Material() {}
 
     Vec3 Shade(const Ray &ray, const Hit &hit,
                    const Vec3 &dirToLight, const Vec3 &lightColor) { // BRDF
@@ -105,28 +174,22 @@ public:
 
     inline double ReLU(double x) { return (x > 0) ? x : .0; }
 
-    Vec3 getColor(Vec3 uv) {
-        if (texture_buf == nullptr) {
+    // color at a hit, filtered over its footprint if it has one; the plain
+    // color if the texture cannot be loaded
+    Vec3 getColor(const Hit &hit) {
+        Vec3 c;
+        if (!texture || !texture.sample(hit.uv, hit.duvdx, hit.duvdy, c)) {
             return color;
         }
-        // int pw = (((int)(uv.x*w)) % w + w) % w;
-        // int ph = (((int)(uv.y*h)) % h + h) % h;
-        // int pw = (int(uv.x*w)) % w;
-        // int ph = (int(uv.y*h)) % h;
-        int pw = uv.x * w;
-        int ph = uv.y * h;
-        int x = ph * w * _c + pw * _c;
-
-        auto c = Vec3(texture_buf[x], texture_buf[x+1], texture_buf[x+2]) / 255.;
         return c;
-        // return Vec3(texture_buf[x], texture_buf[x+1], texture_buf[x+2]) / 255.;
     }
 };
 
-Ray diffuseRay(const Ray &ray, const Hit &hit, unsigned short *Xi) {
+Ray diffuseRay(const Ray &ray, const Hit &hit, Sampler &sampler) {
     // Ideal DIFFUSE reflection
-    double r1 = 2 * M_PI * erand48(Xi); // angle
-    double r2 = erand48(Xi), r2s = sqrt(r2);
+    Vec3 u2 = sampler.get2D();
+    double r1 = 2 * M_PI * u2.x; // angle
+    double r2 = u2.y, r2s = sqrt(r2);
     Vec3 w = hit.normal;
     if (w.dot(ray.dir) > 0)
         w = -w;
@@ -141,21 +204,53 @@ Ray diffuseRay(const Ray &ray, const Hit &hit, unsigned short *Xi) {
     return Ray(x, d);
 }
 
-Ray specularRay(const Ray &ray, const Hit &hit) {
-    return Ray(ray.pointAtParameter(hit.t), ray.dir.reflect(hit.normal));
+// change of the normal from one pixel to the next, along duvdx or duvdy
+inline Vec3 normalDifferential(const Hit &hit, const Vec3 &duv) {
+    return hit.dndu * duv.x + hit.dndv * duv.y;
+}
+
+// The mirror image out of dir about normal n, with the neighbours of the
+// reflected ray. dd is how much the direction changes to the neighbour,
+// dn how much the normal does.
+inline Vec3 reflectDifferential(const Vec3 &dir, const Vec3 &dd, const Vec3 &n, const Vec3 &dn) {
+    double c = dir.dot(n);
+    return dir + dd - (n * (c + dd.dot(n) + dir.dot(dn)) + dn * c) * 2;
+}
+
+// neighbours of out, a ray leaving the hit of ray in one of two directions
+inline void setDifferentials(RayDifferential &out, const RayDifferential &ray, const Hit &hit,
+                             const Vec3 &rx_dir, const Vec3 &ry_dir) {
+    if (!ray.has_differentials || !hit.has_differentials)
+        return;
+    out.rx_origin = out.origin + hit.dpdx;
+    out.ry_origin = out.origin + hit.dpdy;
+    out.rx_dir = rx_dir;
+    out.ry_dir = ry_dir;
+    out.has_differentials = true;
+}
+
+// Mirror reflection. Its neighbours follow the neighbours of ray, reflected
+// about the normal as it turns from the hit to theirs (Igehy, "Tracing Ray
+// Differentials"); they are only kept if computeDifferentials was called.
+RayDifferential specularRay(const RayDifferential &ray, const Hit &hit) {
+    RayDifferential out(ray.pointAtParameter(hit.t), ray.dir.reflect(hit.normal));
+    setDifferentials(out, ray, hit,
+                     reflectDifferential(ray.dir, ray.rx_dir - ray.dir, hit.normal, normalDifferential(hit, hit.duvdx)),
+                     reflectDifferential(ray.dir, ray.ry_dir - ray.dir, hit.normal, normalDifferential(hit, hit.duvdy)));
+    return out;
 }
 
 // TODO: currently assume every object is surrounded by air, can probably improve to object surrounded by object?
-// return <reflect, refract>
-std::pair<std::pair<Ray, double>, std::pair<Ray, double>> refractiveRay(
-        const Ray &ray, const Hit &hit, unsigned short *Xi) {
+// return <reflect, refract>, both with the neighbours of ray carried along
+std::pair<std::pair<RayDifferential, double>, std::pair<RayDifferential, double>> refractiveRay(
+        const RayDifferential &ray, const Hit &hit) {
 
     double n_air = 1;
     double n_material = hit.material->n_material;
     //TODO: understande the math here
     double r0 = square(n_air - n_material) / square(n_air + n_material);
-    auto p = ray.pointAtParameter(hit.t);
-    Ray reflect = Ray(p, ray.dir.reflect(hit.normal));
+    RayDifferential reflect = specularRay(ray, hit);
+    auto p = reflect.origin;
 
     double cos_theta = ray.dir.dot(hit.normal);
     double sin_theta = sqrt(1 - cos_theta * cos_theta);
@@ -172,8 +267,19 @@ std::pair<std::pair<Ray, double>, std::pair<Ray, double>> refractiveRay(
         }
     }
 
-    Vec3 refract_d = norm * (sqrt(1 - sin_theta*sin_theta / (n*n)) - cos_theta/n) + ray.dir / n;
-    Ray refract(p, refract_d);
+    double cos_t = sqrt(1 - sin_theta*sin_theta / (n*n));
+    Vec3 refract_d = norm * (cos_t - cos_theta/n) + ray.dir / n;
+    RayDifferential refract(p, refract_d);
+    // the derivative of refract_d with the direction and the normal
+    double sign = norm.dot(hit.normal) > 0 ? 1 : -1;
+    auto refractDifferential = [&](const Vec3 &dd, const Vec3 &dn) {
+        double dc = dd.dot(norm) + ray.dir.dot(dn);
+        double dcos_t = cos_theta * dc / (n * n * cos_t);
+        return refract_d + dd / n + dn * (cos_t - cos_theta/n) + norm * (dcos_t - dc/n);
+    };
+    setDifferentials(refract, ray, hit,
+                     refractDifferential(ray.rx_dir - ray.dir, normalDifferential(hit, hit.duvdx) * sign),
+                     refractDifferential(ray.ry_dir - ray.dir, normalDifferential(hit, hit.duvdy) * sign));
     double reflect_i = r0 + (1. - r0) * pow((1. - cos_theta), 5);
     double refract_i = 1. - reflect_i;
     return { {reflect, reflect_i}, {refract, refract_i} };
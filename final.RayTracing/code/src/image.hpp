@@ -38,7 +38,7 @@ struct Image {
 
     void SetSize(int w, int h) {
         assert(w > 0 && h > 0);
-        if (data == nullptr)
+        if (data != nullptr)
             delete[] data;
         width = w;
         height = h;
@@ -0,0 +1,64 @@
+#ifndef LIGHTS_HPP_
+#define LIGHTS_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "object3d.hpp"
+#include "group.hpp"
+
+// The emissive objects of a scene that can be sampled directly. A light is
+// picked with probability proportional to its power (area times emission).
+// Emitters that cannot be sampled, such as planes or objects behind a
+// Transform, are left out and are only found by BSDF sampling.
+struct LightList {
+    std::vector<Object3D*> lights;
+    std::vector<double> cdf;
+    std::unordered_map<const Object3D*, double> pick_pdf;
+
+    void build(const Group *group) {
+        lights.clear();
+        cdf.clear();
+        pick_pdf.clear();
+        double total = 0;
+        std::vector<double> power;
+        for (auto obj: group->objects) {
+            if (obj->material == nullptr || obj->material->emission.max() <= 0)
+                continue;
+            double area = obj->area();
+            if (area <= 0)
+                continue;
+            const Vec3& e = obj->material->emission;
+            lights.push_back(obj);
+            power.push_back(area * (e.x + e.y + e.z));
+            total += power.back();
+        }
+        double sum = 0;
+        for (int i = 0; i < (int) lights.size(); i++) {
+            sum += power[i];
+            cdf.push_back(sum / total);
+            pick_pdf[lights[i]] = power[i] / total;
+        }
+    }
+
+    bool empty() const { return lights.empty(); }
+
+    Object3D* sample(double u, double &pdf) const {
+        int i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        i = std::min(i, (int) lights.size() - 1);
+        pdf = pick_pdf.at(lights[i]);
+        return lights[i];
+    }
+
+    // probability of picking obj, 0 if it is not in the list
+    double pdf(const Object3D *obj) const {
+        auto it = pick_pdf.find(obj);
+        return it == pick_pdf.end() ? 0 : it->second;
+    }
+};
+
+// weight of a sample with pdf a, combined with a strategy of pdf b
+inline double powerHeuristic(double a, double b) {
+    return a > 0 ? a * a / (a * a + b * b) : 0;
+}
+
+#endif // LIGHTS_HPP_
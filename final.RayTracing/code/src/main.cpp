@@ -6,35 +6,169 @@
 #include "group.hpp"
 #include "ray_tracer.hpp"
 #include "scene_parser.hpp"
+#include "args.hxx"
 
 using namespace std;
 
 int main(int argc, char *argv[]) {
-    // for (int argNum = 1; argNum < argc; ++argNum) {
-    //     std::cout << "Argument " << argNum << " is: " << argv[argNum] << std::endl;
-    // }
-
-    // if (argc != 3) {
-    //     cout << "Usage: ./bin/PA1 <input scene file> <output bmp file>" << endl;
-    //     return 1;
-    // }
-    // string inputFile = argv[1];
-    if (argc != 2) {
+    args::ArgumentParser parser("Path tracer for the final project.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<int> samples(parser, "n", "Samples per subpixel, 4 subpixels per pixel", {'s', "samples"}, 80);
+    args::ValueFlag<int> tileSize(parser, "pixels", "Edge length of the render tiles", {"tile-size"}, 32);
+    args::ValueFlag<std::string> samplerName(parser, "name", "Sampler: random, stratified, sobol or owen", {"sampler"}, "owen");
+    args::ValueFlag<int> maxDepth(parser, "n", "Maximum number of bounces per path", {"max-depth"}, 64);
+    args::ValueFlag<int> rrDepth(parser, "n", "Bounces before russian roulette starts", {"rr-depth"}, 5);
+    args::Flag noNee(parser, "no-nee", "Disable direct light sampling", {"no-nee"});
+    args::ValueFlag<double> adaptive(parser, "error", "Adaptive sampling: stop subpixels below this relative error", {"adaptive"}, 0);
+    args::ValueFlag<int> adaptiveMin(parser, "n", "Adaptive sampling: samples per subpixel and pass", {"adaptive-min"}, 4);
+    args::ValueFlag<int> adaptiveMax(parser, "n", "Adaptive sampling: cap per subpixel (default 4x --samples)", {"adaptive-max"}, 0);
+    args::ValueFlag<std::string> heatmapFile(parser, "file", "Write a heatmap of the samples per pixel", {"heatmap"});
+    args::ValueFlag<int> progressive(parser, "n", "Progressive rendering in passes of n samples per subpixel", {"progressive"}, 0);
+    args::ValueFlag<std::string> checkpointFile(parser, "file", "Progressive checkpoint (default <output>.ckpt)", {"checkpoint"});
+    args::ValueFlag<double> checkpointEvery(parser, "seconds", "Seconds between checkpoints and previews", {"checkpoint-every"}, 60);
+    args::Flag resume(parser, "resume", "Continue a progressive render from its checkpoint", {"resume"});
+    args::ValueFlag<std::string> hdrFile(parser, "file", "Linear HDR output, .pfm or half float tiled .htf (default <output>.pfm)", {"hdr"});
+    args::ValueFlag<std::string> tiles(parser, "i/N", "Only render part i of N of the tiles (0 <= i < N)", {"tiles"});
+    args::ValueFlag<int> sampleOffset(parser, "n", "Index of the first sample of every subpixel", {"sample-offset"}, 0);
+    args::ValueFlag<int> sampleTotal(parser, "n", "Samples per subpixel of the whole distributed render", {"sample-total"}, 0);
+    args::ValueFlag<std::string> filmFile(parser, "file", "Also save the film, for the merge tool", {"film"});
+    args::Flag packets(parser, "packets", "Trace camera rays in packets of 8x8 pixels", {"packets"});
+    args::Flag wavefront(parser, "wavefront", "Trace paths breadth first, one bounce of many paths at a time", {"wavefront"});
+    args::Flag noMeshCache(parser, "no-mesh-cache", "Always load meshes from their OBJ files", {"no-mesh-cache"});
+    args::ValueFlag<double> textureBudget(parser, "MB", "Memory for textures between passes, least recently used whole textures are evicted then; a single pass, as in a plain render, can use more", {"texture-budget"}, TEXTURE_CACHE_BUDGET / 1048576.);
+    args::ValueFlag<int> sceneId(parser, "id", "Built-in scene to render (1-4)", {"scene"}, 3);
+    args::Positional<std::string> output(parser, "output", "Output bmp file");
+    try {
+        parser.ParseCLI(argc, argv);
+    } catch (args::Help&) {
+        cout << parser;
+        return 0;
+    } catch (args::Error& e) {
+        cerr << e.what() << endl << parser;
+        return 1;
+    }
+    if (!output) {
         cout << "Usage: ./bin/FINAL <output file>" << endl;
         return 1;
     }
-    string outputFile = argv[1];  // only bmp is allowed.
+    string outputFile = args::get(output);  // only bmp is allowed.
+    string hdrOutput = hdrFile ? args::get(hdrFile) : outputFile.substr(0, outputFile.rfind('.')) + ".pfm";
 
     // SceneParser sp(inputFile.c_str());
 
+    Scene (*scenes[])() = {getScene1, getScene2, getScene3, getScene4};
+    int id = args::get(sceneId);
+    if (id < 1 || id > 4) {
+        cerr << "Unknown scene " << id << endl;
+        return 1;
+    }
+    RenderOptions opts(args::get(samples));
+    opts.tile_size = args::get(tileSize);
+    opts.max_depth = args::get(maxDepth);
+    opts.rr_depth = args::get(rrDepth);
+    opts.nee = !noNee;
+    opts.adaptive_threshold = args::get(adaptive);
+    opts.adaptive_min = std::max(1, args::get(adaptiveMin));
+    opts.adaptive_max = args::get(adaptiveMax);
+    opts.pass_samps = args::get(progressive);
+    opts.packets = packets;
+    opts.wavefront = wavefront;
+    Mesh::cacheEnabled() = !noMeshCache;
+    if (args::get(textureBudget) <= 0) {
+        cerr << "--texture-budget must be positive" << endl;
+        return 1;
+    }
+    TextureCache::instance().setBudget((size_t) (args::get(textureBudget) * 1048576));
+    opts.sample_offset = args::get(sampleOffset);
+    opts.sample_total = args::get(sampleTotal);
+    if (tiles && (sscanf(args::get(tiles).c_str(), "%d/%d", &opts.tile_index, &opts.tile_count) != 2
+                  || opts.tile_count < 1 || opts.tile_index < 0 || opts.tile_index >= opts.tile_count)) {
+        cerr << "--tiles takes i/N with 0 <= i < N" << endl;
+        return 1;
+    }
+    if (opts.sample_offset < 0) {
+        cerr << "--sample-offset cannot be negative" << endl;
+        return 1;
+    }
+    if (sampleTotal && opts.sample_total < opts.sample_offset + opts.samps) {
+        cerr << "--sample-total must cover samples [--sample-offset, --sample-offset + --samples)" << endl;
+        return 1;
+    }
+    if (opts.adaptive_threshold > 0 && (tiles || opts.sample_offset > 0)) {
+        cerr << "--adaptive renders the whole frame, it cannot be combined with --tiles or --sample-offset" << endl;
+        return 1;
+    }
+    if (heatmapFile && opts.adaptive_threshold <= 0) {
+        cerr << "--heatmap needs --adaptive" << endl;
+        return 1;
+    }
+    if (opts.pass_samps > 0 && opts.adaptive_threshold > 0) {
+        cerr << "--progressive and --adaptive cannot be combined" << endl;
+        return 1;
+    }
+    if (opts.packets && opts.wavefront) {
+        cerr << "--packets and --wavefront cannot be combined" << endl;
+        return 1;
+    }
+    if (resume && opts.pass_samps <= 0) {
+        cerr << "--resume needs --progressive" << endl;
+        return 1;
+    }
+    if (!parseSamplerType(args::get(samplerName), opts.sampler)) {
+        cerr << "Unknown sampler " << args::get(samplerName) << endl;
+        return 1;
+    }
+    // the strata depend on the sample count, so a part alone cannot know them
+    if (opts.sampler == SamplerType::STRATIFIED && opts.sample_offset > 0 && !sampleTotal) {
+        cerr << "--sampler stratified with --sample-offset needs --sample-total" << endl;
+        return 1;
+    }
+
     Image outImg;
-    Scene sc = getScene3();
-    renderFrame(sc, outImg, 80);
-    // auto sp("../testcases/scene01_basic.txt");
-    // renderFrame(sp, outImg, 40);
-    outImg.SaveImage(outputFile.c_str());
+    Scene sc = scenes[id - 1]();
+    Image heatmap;
+    Film film(sc.camera->width, sc.camera->height);
+    FilmSettings settings = {id, opts.samps, (int) opts.sampler, opts.max_depth, opts.rr_depth, opts.nee,
+                             opts.sample_offset, opts.tile_index, opts.tile_count, opts.sample_total,
+                             opts.tile_size};
+    if (opts.pass_samps > 0) {
+        // the preview replaces the output after every checkpoint
+        string checkpoint = checkpointFile ? args::get(checkpointFile) : outputFile + ".ckpt";
+        if (resume && !film.loadCheckpoint(checkpoint, settings))
+            return 1;
+        auto last = chrono::steady_clock::now();
+        bool finished = false; // the last pass wrote the output
+        renderProgressive(sc, film, opts, [&](const Film& f) {
+            auto now = chrono::steady_clock::now();
+            bool done = f.samples >= opts.samps;
+            if (!done && chrono::duration<double>(now - last).count() < args::get(checkpointEvery))
+                return;
+            if (!f.saveCheckpoint(checkpoint, settings))
+                cerr << "Cannot write checkpoint " << checkpoint << endl;
+            f.resolve(outImg);
+            saveImageAtomic(outImg, outputFile);
+            last = now;
+            finished = done;
+        });
+        // a checkpoint that was complete already leaves no pass to write it
+        if (!finished) {
+            film.resolve(outImg);
+            saveImageAtomic(outImg, outputFile);
+        }
+    } else {
+        renderFrame(sc, film, opts, heatmapFile ? &heatmap : nullptr);
+        // auto sp("../testcases/scene01_basic.txt");
+        // renderFrame(sp, outImg, 40);
+        film.resolve(outImg);
+        outImg.SaveImage(outputFile.c_str());
+    }
+    if (!film.saveHDR(hdrOutput))
+        cerr << "Cannot write " << hdrOutput << endl;
+    if (filmFile && !film.saveCheckpoint(args::get(filmFile), settings))
+        cerr << "Cannot write " << args::get(filmFile) << endl;
+    if (heatmapFile)
+        heatmap.SaveImage(args::get(heatmapFile).c_str());
 
     // cout << "Hello! Computer Graphics!" << endl;
     return 0;
 }
-
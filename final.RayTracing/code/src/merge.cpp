@@ -0,0 +1,103 @@
+// Merges the films of a distributed render into the final image. Every
+// part was rendered by `main --film` with other --tiles or --sample-offset
+// values; pixels are combined weighted by their sample counts.
+//     ./merge -o output.bmp part0.film part1.film ...
+#include "common.hpp"
+#include "image.hpp"
+#include "film.hpp"
+#include "scheduler.hpp"
+#include "args.hxx"
+
+using namespace std;
+
+// The tiles and samples a part rendered: a run of the tile list and a
+// range of sample indices. Parts that share both would count the same
+// samples twice.
+struct PartRange {
+    long long tile_lo, tile_hi;
+    int sample_lo, sample_hi;
+
+    PartRange(const Film& film, const FilmSettings& s) {
+        long long n = makeTiles(film.width, film.height, s.tile_size).size();
+        tile_lo = n * s.tile_index / s.tile_count;
+        tile_hi = n * (s.tile_index + 1) / s.tile_count;
+        sample_lo = s.sample_offset;
+        sample_hi = s.sample_offset + s.samps;
+    }
+
+    bool overlaps(const PartRange& o) const {
+        return tile_lo < o.tile_hi && o.tile_lo < tile_hi && sample_lo < o.sample_hi && o.sample_lo < sample_hi;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    args::ArgumentParser parser("Merge partial renders into one image.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> output(parser, "file", "Output bmp file", {'o', "output"});
+    args::ValueFlag<std::string> hdrFile(parser, "file", "Linear HDR output, .pfm or .htf (default <output>.pfm)", {"hdr"});
+    args::ValueFlag<std::string> filmFile(parser, "file", "Also save the merged film", {"film"});
+    args::PositionalList<std::string> inputs(parser, "films", "Films to merge");
+    try {
+        parser.ParseCLI(argc, argv);
+    } catch (args::Help&) {
+        cout << parser;
+        return 0;
+    } catch (args::Error& e) {
+        cerr << e.what() << endl << parser;
+        return 1;
+    }
+    if (!output || args::get(inputs).empty()) {
+        cerr << parser;
+        return 1;
+    }
+
+    const auto& paths = args::get(inputs);
+    Film film(0, 0);
+    FilmSettings settings;
+    if (!film.load(paths[0], settings))
+        return 1;
+    vector<PartRange> ranges(1, PartRange(film, settings));
+    for (size_t i = 1; i < paths.size(); i++) {
+        Film part(0, 0);
+        FilmSettings part_settings;
+        if (!part.load(paths[i], part_settings))
+            return 1;
+        if (part.width != film.width || part.height != film.height || !part_settings.sameImage(settings)) {
+            cerr << paths[i] << " is a render of another frame than " << paths[0] << endl;
+            return 1;
+        }
+        PartRange range(part, part_settings);
+        for (size_t j = 0; j < ranges.size(); j++) {
+            if (range.overlaps(ranges[j])) {
+                cerr << paths[i] << " has samples of the same pixels as " << paths[j] << endl;
+                return 1;
+            }
+        }
+        ranges.push_back(range);
+        film.merge(part);
+    }
+
+    long long empty = 0;
+    for (float n : film.count)
+        empty += n == 0;
+    if (empty)
+        cerr << "Warning: " << empty << " pixels have no samples" << endl;
+
+    string outputFile = args::get(output);
+    string hdrOutput = hdrFile ? args::get(hdrFile) : outputFile.substr(0, outputFile.rfind('.')) + ".pfm";
+    Image img;
+    film.resolve(img);
+    img.SaveImage(outputFile.c_str());
+    if (!film.saveHDR(hdrOutput)) {
+        cerr << "Cannot write " << hdrOutput << endl;
+        return 1;
+    }
+    // a merged film has no single tile or sample range of its own
+    settings.sample_offset = settings.tile_index = 0;
+    settings.tile_count = 1;
+    if (filmFile && !film.saveCheckpoint(args::get(filmFile), settings)) {
+        cerr << "Cannot write " << args::get(filmFile) << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -5,6 +5,16 @@
 #include "object3d.hpp"
 #include "vec.hpp"
 #include "mat44.hpp"
+#include "bvh.hpp"
+#include "simd.hpp"
+#include "mesh_cache.hpp"
+#include "obj_parser.hpp"
+
+// mesh_type: normals from the OBJ file where it has them, flat otherwise
+#define MESH_FILE_NORMALS 0
+// smooth normals everywhere, averaged over the faces around every vertex
+// if the file has none
+#define MESH_SMOOTH_NORMALS 1
 
 class Mesh : public Object3D {
 public:
@@ -17,100 +27,472 @@ public:
         int x[3]{};
     };
 
+    // vertex and edge data precomputed for the intersection kernel
+    struct TriangleData {
+        Vec3 v0, e1, e2;
+        Vec3 normal;
+    };
+
+    // Corner attributes of a triangle, only read for the closest hit. The
+    // 60 bytes a hit needs lie together, in one or two cache lines as
+    // std::vector does not align them.
+    struct TriangleShading {
+        float n[3][3];
+        float uv[3][2];
+    };
+
     std::vector<Vec3> v;
     std::vector<TriangleIndex> t;
+    std::vector<TriangleData> tris;
+    // float copies of the triangles of every BVH leaf, used by the SIMD path
+    std::vector<TrianglePacket> packets;
+    std::vector<int> leaf_packet; // first packet of each leaf node
+    std::vector<double> area_cdf; // running sum of triangle areas, built by area()
     std::vector<Vec3> n;
     std::vector<Vec3> uv;
+    // per triangle, empty if the mesh has neither vertex normals nor uvs
+    std::vector<TriangleShading> shading;
+    bool smooth; // shading holds normals
+    bool has_uv; // shading holds texture coordinates
     int mesh_type;
+    std::string name;
+    BVH bvh;
+#ifdef BVH_STATS
+    std::atomic<long long> stat_rays{0}, stat_nodes{0};
+#endif
 
-    Mesh(const char *filename, Material *m, int type_=0) {
+    Mesh(const char *filename, Material *m, int type_=MESH_FILE_NORMALS) :
+        Object3D(m), smooth(false), has_uv(false), name(filename) {
         mesh_type = type_;
-        // Optional: Use tiny obj loader to replace this simple one.
-        std::ifstream f;
-        f.open(filename);
-        if (!f.is_open()) {
-            std::cout << "Cannot open " << filename << "\n";
+        if (cacheEnabled() && loadCache())
             return;
+        ObjData obj;
+        if (!ObjParser::parse(filename, obj))
+            return;
+        v = std::move(obj.v);
+        // TODO: rust version uses -y
+        uv = std::move(obj.vt);
+        n = std::move(obj.vn);
+        t.resize(obj.triangles());
+        for (int triId = 0; triId < (int) t.size(); ++triId)
+            for (int ii = 0; ii < 3; ii++)
+                t[triId][ii] = obj.corners[3 * triId + ii].v;
+        computeTriangleData();
+        computeShading(obj.corners);
+        buildBVH();
+        if (cacheEnabled())
+            saveCache();
+    }
+
+    // Meshes are cached in a binary file next to their OBJ file, holding
+    // everything the constructor computes. Turned off by --no-mesh-cache.
+    static bool& cacheEnabled() {
+        static bool enabled = true;
+        return enabled;
+    }
+
+    std::string cachePath() const { return name + ".meshcache"; }
+
+    // Load the mesh from its cache; false if there is none or its OBJ file
+    // changed since it was written.
+    bool loadCache() {
+        auto start = std::chrono::steady_clock::now();
+        MeshCacheSource source;
+        MappedFile file;
+        if (!source.read(name) || !file.open(cachePath()) || file.size < sizeof(MeshCacheHeader))
+            return false;
+        MeshCacheHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        int leaf_width = simd_level == SimdLevel::SCALAR ? 1 : TRI_PACKET_WIDTH;
+        if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION
+            || header.mesh_type != mesh_type || header.leaf_width != leaf_width
+            || header.source.mtime_ns != source.mtime_ns || header.source.size != source.size)
+            return false;
+        if (!source.readHash(name) || header.source.hash != source.hash)
+            return false;
+
+        MeshCacheReader in(file, sizeof(header));
+        in.get(v, header.sizes[0]);
+        in.get(t, header.sizes[1]);
+        in.get(n, header.sizes[2]);
+        in.get(uv, header.sizes[3]);
+        in.get(tris, header.sizes[4]);
+        in.get(bvh.nodes, header.sizes[5]);
+        in.get(bvh.indices, header.sizes[6]);
+        in.get(packets, header.sizes[7]);
+        in.get(leaf_packet, header.sizes[8]);
+        in.get(shading, header.sizes[9]);
+        bvh.leaf_width = leaf_width;
+        smooth = header.shading & 1;
+        has_uv = header.shading & 2;
+        if (!in.good()) {
+            printf("Mesh cache %s is truncated\n", cachePath().c_str());
+            v.clear(), t.clear(), n.clear(), uv.clear(), tris.clear();
+            bvh = BVH();
+            packets.clear(), leaf_packet.clear(), shading.clear();
+            return false;
+        }
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        printf("Mesh %s: %d triangles, %d BVH nodes, loaded from cache in %.1f ms\n",
+               name.c_str(), (int) t.size(), (int) bvh.nodes.size(), ms);
+#ifdef BVH_STATS
+        registry().push_back(this);
+#endif
+        return true;
+    }
+
+    // Write the cache through a temporary file of its own, so that a render
+    // started at the same time never maps half of one, even when several
+    // processes write the same cache at once.
+    void saveCache() const {
+        MeshCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        if (!header.source.read(name) || !header.source.readHash(name))
+            return;
+        header.magic = MESH_CACHE_MAGIC;
+        header.version = MESH_CACHE_VERSION;
+        header.mesh_type = mesh_type;
+        header.leaf_width = bvh.leaf_width;
+        header.shading = smooth | has_uv << 1;
+        int sizes[] = {(int) v.size(), (int) t.size(), (int) n.size(), (int) uv.size(), (int) tris.size(),
+                       (int) bvh.nodes.size(), (int) bvh.indices.size(), (int) packets.size(),
+                       (int) leaf_packet.size(), (int) shading.size()};
+        memcpy(header.sizes, sizes, sizeof(sizes));
+
+        std::string path = cachePath(), tmp = tempPath(path);
+        FILE *file = fopen(tmp.c_str(), "wb");
+        if (file == nullptr) {
+            printf("Cannot write mesh cache %s\n", path.c_str());
+            return;
+        }
+        MeshCacheWriter out(file);
+        out.put(&header, sizeof(header));
+        out.put(v);
+        out.put(t);
+        out.put(n);
+        out.put(uv);
+        out.put(tris);
+        out.put(bvh.nodes);
+        out.put(bvh.indices);
+        out.put(packets);
+        out.put(leaf_packet);
+        out.put(shading);
+        bool ok = fclose(file) == 0 && out.good();
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            printf("Cannot write mesh cache %s\n", path.c_str());
+            remove(tmp.c_str());
         }
-        std::string line;
-        std::string vTok("v");
-        std::string fTok("f");
-        std::string texTok("vt");
-        std::string vnTok("vn");
-        char bslash = '/', space = ' ';
-        std::string tok;
-        int texID;
-        while (true) {
-            std::getline(f, line);
-            if (f.eof()) { break; }
-            if (line.size() < 3) { continue; }
-            if (line.at(0) == '#') { continue; }
-            std::stringstream ss(line);
-            ss >> tok;
-            if (tok == vTok) { // geometric vertices
-                Vec3 vec;
-                ss >> vec.x >> vec.y >> vec.z;
-                v.push_back(vec);
-            } else if (tok == fTok) { // face
-                if (line.find(bslash) != std::string::npos) {
-                    std::replace(line.begin(), line.end(), bslash, space);
-                    std::stringstream facess(line);
-                    TriangleIndex trig;
-                    facess >> tok;
-                    for (int ii = 0; ii < 3; ii++) {
-                        facess >> trig[ii] >> texID;
-                        trig[ii]--;
+    }
+
+    bool intersect(const Ray &r, Hit &h, double tmin) override {
+        double t, u, v;
+        int best = findHit(r, tmin, h.t, false, t, u, v);
+        if (best < 0)
+            return false;
+        setHit(h, best, t, u, v);
+        return true;
+    }
+
+    // The rays of the packet go down the BVH together; in the leaves each
+    // of them tests the triangles on its own, the way findHit does.
+    LaneMask intersectPacket(RayPacket &p, LaneMask mask) override {
+        int best[PACKET_SIZE];
+        double best_u[PACKET_SIZE], best_v[PACKET_SIZE];
+        forEachLane(mask, [&](int i) { best[i] = -1; });
+        SimdLevel level = simd_level;
+        bvh.traversePacket(p, mask, [&](int node, LaneMask lanes) {
+            forEachLane(lanes, [&](int i) {
+                Ray r = p.ray(i);
+                double &tmax = p.t_max[i];
+                auto test = [&](int triId) {
+                    const TriangleData& tri = tris[triId];
+                    double t_hit, u, v;
+                    if (intersectTriangle(r, tri.v0, tri.e1, tri.e2, p.t_min, tmax, t_hit, u, v)) {
+                        tmax = t_hit;
+                        best[i] = triId;
+                        best_u[i] = u, best_v[i] = v;
                     }
-                    t.push_back(trig);
-                } else {
-                    TriangleIndex trig;
-                    for (int ii = 0; ii < 3; ii++) {
-                        ss >> trig[ii];
-                        trig[ii]--;
+                };
+                const BVH::Node& leaf = bvh.nodes[node];
+                if (level == SimdLevel::SCALAR || packets.empty()) {
+                    for (int k = leaf.offset; k < leaf.offset + leaf.count; k++)
+                        test(bvh.indices[k]);
+                    return;
+                }
+                PacketRay pr(r.origin, r.dir, p.t_min, tmax);
+                int end = leaf_packet[node] + packetCount(leaf.count);
+                for (int k = leaf_packet[node]; k < end; k++) {
+                    forEachLane(packetCandidates(packets[k], pr, level), [&](int lane) {
+                        test(packets[k].id[lane]);
+                    });
+                }
+            });
+        });
+        LaneMask hit = 0;
+        forEachLane(mask, [&](int i) {
+            if (best[i] < 0)
+                return;
+            setHit(p.hits[i], best[i], p.t_max[i], best_u[i], best_v[i]);
+            hit |= laneBit(i);
+        });
+        return hit;
+    }
+
+    // fill in h for a hit of triangle best at t, at barycentric (u, v)
+    void setHit(Hit &h, int best, double t, double u, double v) {
+        if (shading.empty()) {
+            // uv holds the barycentric coordinates of the hit
+            h.set(t, material, tris[best].normal, Vec3(u, v), tris[best].e1, tris[best].e2);
+            return;
+        }
+        const TriangleShading& s = shading[best];
+        double w = 1 - u - v;
+        Vec3 normal = tris[best].normal;
+        if (smooth) {
+            Vec3 ns(w * s.n[0][0] + u * s.n[1][0] + v * s.n[2][0],
+                    w * s.n[0][1] + u * s.n[1][1] + v * s.n[2][1],
+                    w * s.n[0][2] + u * s.n[1][2] + v * s.n[2][2]);
+            double len = ns.len();
+            if (len > 0)
+                normal = ns / len;
+        }
+        const TriangleData& tri = tris[best];
+        if (!has_uv) {
+            h.set(t, material, normal, Vec3(u, v), tri.e1, tri.e2);
+            return;
+        }
+        Vec3 texcoord(w * s.uv[0][0] + u * s.uv[1][0] + v * s.uv[2][0],
+                      w * s.uv[0][1] + u * s.uv[1][1] + v * s.uv[2][1]);
+        // invert the uv differences along the edges
+        double du1 = s.uv[1][0] - s.uv[0][0], dv1 = s.uv[1][1] - s.uv[0][1];
+        double du2 = s.uv[2][0] - s.uv[0][0], dv2 = s.uv[2][1] - s.uv[0][1];
+        double det = du1 * dv2 - dv1 * du2;
+        Vec3 dpdu, dpdv;
+        if (det != 0) {
+            dpdu = (tri.e1 * dv2 - tri.e2 * dv1) / det;
+            dpdv = (tri.e2 * du1 - tri.e1 * du2) / det;
+        }
+        h.set(t, material, normal, texcoord, dpdu, dpdv);
+    }
+
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        double t, u, v;
+        return findHit(r, tmin, tmax, true, t, u, v) >= 0;
+    }
+
+    // Index of the closest triangle hit in (tmin, tmax), or of the first one
+    // found if any_hit is set; -1 if there is none.
+    int findHit(const Ray &r, double tmin, double tmax, bool any_hit,
+                double &best_t, double &best_u, double &best_v) {
+        int *visited = nullptr;
+#ifdef BVH_STATS
+        int nodes_visited = 0;
+        visited = &nodes_visited;
+#endif
+        int best = -1;
+        auto test = [&](int triId, double &tmax) {
+            const TriangleData& tri = tris[triId];
+            double t_hit, u, v;
+            if (intersectTriangle(r, tri.v0, tri.e1, tri.e2, tmin, tmax, t_hit, u, v)) {
+                tmax = best_t = t_hit;
+                best_u = u, best_v = v;
+                best = triId;
+                return true;
+            }
+            return false;
+        };
+        SimdLevel level = simd_level;
+        if (level == SimdLevel::SCALAR || packets.empty()) {
+            bvh.intersect(r, tmin, tmax, test, any_hit, visited);
+        } else {
+            // the float kernel only filters, candidates get the exact double test
+            PacketRay pr(r.origin, r.dir, tmin, tmax);
+            bvh.traverse(r, tmin, tmax, [&](int node, double &tmax) {
+                bool hit = false;
+                int end = leaf_packet[node] + packetCount(bvh.nodes[node].count);
+                for (int k = leaf_packet[node]; k < end; k++) {
+                    const TrianglePacket& packet = packets[k];
+                    int mask = packetCandidates(packet, pr, level);
+                    while (mask) {
+                        int lane = __builtin_ctz(mask);
+                        mask &= mask - 1;
+                        hit |= test(packet.id[lane], tmax);
+                        if (hit && any_hit)
+                            return true;
                     }
-                    t.push_back(trig);
                 }
-            } else if (tok == texTok) { // texture vertices
-                // TODO: rust version uses -y
-                Vec3 texcoord;
-                ss >> texcoord.x >> texcoord.y;
-                uv.push_back(texcoord);
-            } else if (tok == vnTok) { // vertex normals
-                Vec3 normal;
-                ss >> normal.x >> normal.y >> normal.z;
-                n.push_back(normal);
+                if (hit)
+                    pr = PacketRay(r.origin, r.dir, tmin, tmax);
+                return hit;
+            }, any_hit, visited);
+        }
+#ifdef BVH_STATS
+        stat_rays++;
+        stat_nodes += nodes_visited;
+#endif
+        return best;
+    }
+
+    void computeTriangleData() {
+        tris.resize(t.size());
+        for (int triId = 0; triId < (int) t.size(); ++triId) {
+            TriangleIndex& triIndex = t[triId];
+            TriangleData& tri = tris[triId];
+            tri.v0 = v[triIndex[0]];
+            tri.e1 = v[triIndex[1]] - tri.v0;
+            tri.e2 = v[triIndex[2]] - tri.v0;
+            tri.normal = tri.e1.cross(tri.e2).normalized();
+        }
+    }
+
+    bool getBounds(AABB &box) override {
+        if (bvh.empty())
+            return false;
+        box = bvh.nodes[0].box;
+        return true;
+    }
+
+    // Only emissive meshes pay for the table, so it is built on first use.
+    double area() override {
+        if (area_cdf.empty() && !tris.empty()) {
+            area_cdf.resize(tris.size());
+            double sum = 0;
+            for (int triId = 0; triId < (int) tris.size(); ++triId) {
+                sum += tris[triId].e1.cross(tris[triId].e2).len() / 2;
+                area_cdf[triId] = sum;
             }
         }
-        f.close();
-        if (mesh_type == 0)
-            computeNormal();
+        return area_cdf.empty() ? 0 : area_cdf.back();
     }
 
-    bool intersect(const Ray &r, Hit &h, double tmin) override {
-        // Optional: Change this brute force method into a faster one.
-        // TODO: kdtree here
-        bool result = false;
-        Hit h_tmp;
+    // pick a triangle by area, then reuse u.x as a fresh uniform number
+    void samplePoint(const Vec3 &u, Vec3 &p, Vec3 &n) override {
+        double total = area();
+        double target = u.x * total;
+        int triId = std::upper_bound(area_cdf.begin(), area_cdf.end(), target) - area_cdf.begin();
+        triId = std::min(triId, (int) tris.size() - 1);
+        double lo = triId ? area_cdf[triId - 1] : 0;
+        double tri_area = area_cdf[triId] - lo;
+        double ux = tri_area > 0 ? std::min((target - lo) / tri_area, 1. - 1e-16) : 0;
+        const TriangleData& tri = tris[triId];
+        p = sampleTriangle(Vec3(ux, u.y), tri.v0, tri.e1, tri.e2);
+        n = tri.normal;
+    }
+
+    void buildBVH() {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<AABB> boxes(t.size());
         for (int triId = 0; triId < (int) t.size(); ++triId) {
             TriangleIndex& triIndex = t[triId];
-            Triangle triangle(v[triIndex[0]],
-                            v[triIndex[1]], v[triIndex[2]], material);
-            triangle.normal = n[triId];
-            result |= triangle.intersect(r, h_tmp, tmin);
-            if (h_tmp.t < h.t) h = h_tmp;
+            boxes[triId] = AABB(v[triIndex[0]], v[triIndex[1]]);
+            boxes[triId].expand(v[triIndex[2]]);
+        }
+        if (simd_level == SimdLevel::SCALAR) {
+            bvh.build(boxes);
+        } else {
+            bvh.build(boxes, TRI_PACKET_WIDTH);
+            buildPackets();
+        }
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+        printf("Mesh %s: %d triangles, %d BVH nodes, built in %.1f ms\n",
+               name.c_str(), (int) t.size(), (int) bvh.nodes.size(), ms);
+#ifdef BVH_STATS
+        registry().push_back(this);
+#endif
+    }
+
+    static int packetCount(int count) {
+        return (count + TRI_PACKET_WIDTH - 1) / TRI_PACKET_WIDTH;
+    }
+
+    // gather the triangles of every leaf into packets
+    void buildPackets() {
+        packets.clear();
+        leaf_packet.assign(bvh.nodes.size(), -1);
+        for (int node = 0; node < (int) bvh.nodes.size(); node++) {
+            const BVH::Node& leaf = bvh.nodes[node];
+            if (leaf.count == 0) continue;
+            leaf_packet[node] = packets.size();
+            for (int i = 0; i < leaf.count; i++) {
+                if (i % TRI_PACKET_WIDTH == 0)
+                    packets.emplace_back();
+                TrianglePacket& packet = packets.back();
+                int lane = i % TRI_PACKET_WIDTH;
+                int triId = bvh.indices[leaf.offset + i];
+                const TriangleData& tri = tris[triId];
+                const Vec3* src[3] = {&tri.v0, &tri.e1, &tri.e2};
+                float (*dst[3])[TRI_PACKET_WIDTH] = {packet.v0, packet.e1, packet.e2};
+                for (int j = 0; j < 3; j++) {
+                    dst[j][0][lane] = src[j]->x;
+                    dst[j][1][lane] = src[j]->y;
+                    dst[j][2][lane] = src[j]->z;
+                }
+                packet.id[lane] = triId;
+            }
+        }
+    }
+
+#ifdef BVH_STATS
+    static std::vector<Mesh*>& registry() {
+        static std::vector<Mesh*> meshes;
+        return meshes;
+    }
+
+    // average number of BVH nodes visited per ray, for every loaded mesh
+    static void reportStats() {
+        for (auto mesh : registry()) {
+            long long rays = mesh->stat_rays, nodes = mesh->stat_nodes;
+            printf("Mesh %s: %lld rays, %.2f nodes visited per ray\n",
+                   mesh->name.c_str(), rays, rays ? (double) nodes / rays : 0.);
         }
-        return result;
     }
+#endif
 
-    // Normal can be used for light estimation
+    // Vertex normals averaged over the faces around every vertex, weighted
+    // by their area
     void computeNormal() {
-        n.resize(t.size());
+        n.assign(v.size(), Vec3());
         for (int triId = 0; triId < (int) t.size(); ++triId) {
             TriangleIndex& triIndex = t[triId];
             Vec3 a = v[triIndex[1]] - v[triIndex[0]];
             Vec3 b = v[triIndex[2]] - v[triIndex[0]];
             b = a.cross(b);
-            n[triId] = b / b.len();
+            for (int ii = 0; ii < 3; ii++)
+                n[triIndex[ii]] += b;
+        }
+        for (auto& normal : n) {
+            double len = normal.len();
+            if (len > 0)
+                normal = normal / len;
+        }
+    }
+
+    // Gather the vertex normals and uvs of every corner into shading. A
+    // triangle without vn falls back to its face normal at all corners.
+    void computeShading(const std::vector<ObjIndex>& corners) {
+        bool file_normals = false;
+        for (auto& c : corners) {
+            file_normals |= c.vn >= 0;
+            has_uv |= c.vt >= 0;
+        }
+        smooth = file_normals || mesh_type == MESH_SMOOTH_NORMALS;
+        if (smooth && !file_normals)
+            computeNormal();
+        if (!smooth && !has_uv)
+            return;
+        shading.resize(t.size());
+        for (int triId = 0; triId < (int) t.size(); ++triId) {
+            TriangleShading& s = shading[triId];
+            for (int ii = 0; ii < 3; ii++) {
+                const ObjIndex& c = corners[3 * triId + ii];
+                int ni = file_normals ? c.vn : c.v;
+                const Vec3& normal = ni >= 0 ? n[ni] : tris[triId].normal;
+                s.n[ii][0] = normal.x, s.n[ii][1] = normal.y, s.n[ii][2] = normal.z;
+                Vec3 texcoord = c.vt >= 0 ? uv[c.vt] : Vec3();
+                s.uv[ii][0] = texcoord.x, s.uv[ii][1] = texcoord.y;
+            }
         }
     }
 };
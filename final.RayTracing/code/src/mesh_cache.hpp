@@ -0,0 +1,158 @@
+#ifndef MESH_CACHE_HPP_
+#define MESH_CACHE_HPP_
+
+#include "common.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MESH_CACHE_MAGIC 0x4843534d // "MSCH"
+#define MESH_CACHE_VERSION 3
+#define MESH_CACHE_ALIGN 64
+
+// A whole file mapped read-only into memory
+class MappedFile {
+public:
+    const char *data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok) {
+                data = (const char*) p;
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    void close() {
+        if (data != nullptr)
+            munmap((void*) data, size);
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// 64 bit FNV-1a, eight bytes at a time
+inline uint64_t hashBytes(const char *data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++)
+        h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// What a cache was built from. A cache is only used if its source still has
+// the same modification time, size and contents.
+struct MeshCacheSource {
+    int64_t mtime_ns;
+    uint64_t size;
+    uint64_t hash;
+
+    bool read(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+        mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        size = st.st_size;
+        hash = 0;
+        return true;
+    }
+
+    // hashing reads the whole source, so it is only done once the cheap
+    // checks passed
+    bool readHash(const std::string& path) {
+        MappedFile file;
+        if (!file.open(path) && size > 0)
+            return false;
+        hash = hashBytes(file.data, file.size);
+        return true;
+    }
+};
+
+// Header of a cache file, followed by the arrays it lists, each starting at
+// a multiple of MESH_CACHE_ALIGN bytes.
+struct MeshCacheHeader {
+    uint32_t magic, version;
+    MeshCacheSource source;
+    int32_t mesh_type;
+    int32_t leaf_width; // of the BVH, which is 1 without SIMD packets
+    int32_t shading;    // 1: smooth normals, 2: texture coordinates
+    int32_t sizes[10];  // element counts of the arrays
+};
+
+inline size_t alignCacheOffset(size_t offset) {
+    return (offset + MESH_CACHE_ALIGN - 1) / MESH_CACHE_ALIGN * MESH_CACHE_ALIGN;
+}
+
+// Writes the arrays of a cache in order, with padding in between
+class MeshCacheWriter {
+public:
+    explicit MeshCacheWriter(FILE *file_) : file(file_), offset(0), ok(true) {}
+
+    void put(const void *p, size_t bytes) {
+        static const char zeros[MESH_CACHE_ALIGN] = {};
+        size_t pad = alignCacheOffset(offset) - offset;
+        ok = ok && fwrite(zeros, 1, pad, file) == pad && fwrite(p, 1, bytes, file) == bytes;
+        offset += pad + bytes;
+    }
+
+    template <class T>
+    void put(const std::vector<T>& array) { put(array.data(), array.size() * sizeof(T)); }
+
+    bool good() const { return ok; }
+
+private:
+    FILE *file;
+    size_t offset;
+    bool ok;
+};
+
+// Reads the arrays of a mapped cache in the order they were written
+class MeshCacheReader {
+public:
+    MeshCacheReader(const MappedFile& file_, size_t offset_) : file(file_), offset(offset_), ok(true) {}
+
+    template <class T>
+    void get(std::vector<T>& array, int count) {
+        offset = alignCacheOffset(offset);
+        size_t bytes = (size_t) count * sizeof(T);
+        if (!ok || count < 0 || offset + bytes > file.size) {
+            ok = false;
+            return;
+        }
+        array.resize(count);
+        memcpy((void*) array.data(), file.data + offset, bytes);
+        offset += bytes;
+    }
+
+    bool good() const { return ok; }
+
+private:
+    const MappedFile& file;
+    size_t offset;
+    bool ok;
+};
+
+#endif // MESH_CACHE_HPP_
@@ -0,0 +1,269 @@
+#ifndef OBJ_PARSER_HPP_
+#define OBJ_PARSER_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "mesh_cache.hpp"
+#include "scheduler.hpp"
+
+// files smaller than this are parsed by a single thread
+#define OBJ_PARALLEL_MIN_BYTES (1 << 20)
+// marks a negative index that still needs the vertex count of the chunks
+// before the one it was read in
+#define OBJ_RELATIVE_BASE (1 << 30)
+
+// One corner of a face: 0-based indices into v, vt and vn, -1 if absent
+struct ObjIndex {
+    int v, vt, vn;
+};
+
+// Geometry of an OBJ file. Faces are fan triangulated, three corners per
+// triangle.
+struct ObjData {
+    std::vector<Vec3> v, vt, vn;
+    std::vector<ObjIndex> corners;
+
+    int triangles() const { return corners.size() / 3; }
+};
+
+// Parses an OBJ file straight from a read-only mapping, without copying
+// lines or allocating per token. Large files are cut into chunks at line
+// breaks and parsed in parallel; negative (relative) indices are resolved
+// when the chunks are joined.
+class ObjParser {
+public:
+    // Parse path into out with up to threads threads, 0 for all workers.
+    static bool parse(const std::string& path, ObjData& out, int threads=0) {
+        MappedFile file;
+        if (!file.open(path)) {
+            printf("Cannot open %s\n", path.c_str());
+            return false;
+        }
+        return parse(file.data, file.data + file.size, out, threads, path);
+    }
+
+    static bool parse(const char *begin, const char *end, ObjData& out, int threads=0,
+                      const std::string& name="OBJ data") {
+        if (threads <= 0)
+            threads = workerCount();
+        int chunks = end - begin < OBJ_PARALLEL_MIN_BYTES ? 1 : threads;
+        std::vector<const char*> cuts(chunks + 1, end);
+        cuts[0] = begin;
+        for (int i = 1; i < chunks; i++) {
+            const char *p = std::max(begin + (end - begin) * i / chunks, cuts[i - 1]);
+            while (p < end && p[-1] != '\n') p++;
+            cuts[i] = p;
+        }
+
+        std::vector<ObjData> parts(chunks);
+        std::vector<int> errors(chunks, 0);
+        #pragma omp parallel for num_threads(chunks) schedule(static, 1)
+        for (int i = 0; i < chunks; i++)
+            errors[i] = parseChunk(cuts[i], cuts[i + 1], parts[i]);
+        for (int i = 0; i < chunks; i++) {
+            if (errors[i]) {
+                printf("%s: cannot parse line %d of chunk %d\n", name.c_str(), errors[i], i);
+                return false;
+            }
+        }
+        return join(parts, out, name);
+    }
+
+private:
+    // Parse the lines in [p, end); returns 0, or the line number of the
+    // first malformed line.
+    static int parseChunk(const char *p, const char *end, ObjData& out) {
+        // rough guess from the bunny and horse files, saves reallocations
+        out.v.reserve((end - p) / 80);
+        out.corners.reserve((end - p) / 30);
+        std::vector<ObjIndex> face;
+        int line = 0;
+        while (p < end) {
+            line++;
+            const char *eol = (const char*) memchr(p, '\n', end - p);
+            if (eol == nullptr) eol = end;
+            skipSpace(p, eol);
+            bool ok = true;
+            if (p + 1 < eol && p[0] == 'v' && isSpace(p[1])) {
+                p++;
+                Vec3 vec;
+                ok = parseDouble(p, eol, vec.x) && parseDouble(p, eol, vec.y) && parseDouble(p, eol, vec.z);
+                out.v.push_back(vec);
+            } else if (p + 2 < eol && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+                p += 2;
+                Vec3 texcoord;
+                ok = parseDouble(p, eol, texcoord.x);
+                // the second coordinate is optional
+                if (ok && !parseDouble(p, eol, texcoord.y))
+                    texcoord.y = 0;
+                out.vt.push_back(texcoord);
+            } else if (p + 2 < eol && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+                p += 2;
+                Vec3 normal;
+                ok = parseDouble(p, eol, normal.x) && parseDouble(p, eol, normal.y) && parseDouble(p, eol, normal.z);
+                out.vn.push_back(normal);
+            } else if (p + 1 < eol && p[0] == 'f' && isSpace(p[1])) {
+                p++;
+                face.clear();
+                ObjIndex corner;
+                while (parseCorner(p, eol, out, corner))
+                    face.push_back(corner);
+                skipSpace(p, eol);
+                ok = face.size() >= 3 && p == eol;
+                for (int i = 1; ok && i + 1 < (int) face.size(); i++) {
+                    out.corners.push_back(face[0]);
+                    out.corners.push_back(face[i]);
+                    out.corners.push_back(face[i + 1]);
+                }
+            }
+            // comments, groups, materials and anything else are skipped
+            if (!ok)
+                return line;
+            p = eol + 1;
+        }
+        return 0;
+    }
+
+    // v, v/vt, v//vn or v/vt/vn
+    static bool parseCorner(const char *&p, const char *end, const ObjData& data, ObjIndex& corner) {
+        skipSpace(p, end);
+        corner.vt = corner.vn = -1;
+        if (!parseIndex(p, end, data.v.size(), corner.v))
+            return false;
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/' && !parseIndex(p, end, data.vt.size(), corner.vt))
+                return false;
+            if (p < end && *p == '/') {
+                p++;
+                if (!parseIndex(p, end, data.vn.size(), corner.vn))
+                    return false;
+            }
+        }
+        return p == end || isSpace(*p);
+    }
+
+    // 1-based or negative OBJ index; count is the number of elements read
+    // so far in this chunk
+    static bool parseIndex(const char *&p, const char *end, int count, int& index) {
+        bool negative = p < end && *p == '-';
+        const char *q = p + negative;
+        if (q == end || !isDigit(*q))
+            return false;
+        long long value = 0;
+        while (q < end && isDigit(*q) && value < OBJ_RELATIVE_BASE)
+            value = value * 10 + (*q++ - '0');
+        if (value == 0 || value >= OBJ_RELATIVE_BASE / 2)
+            return false;
+        p = q;
+        index = negative ? count - (int) value - OBJ_RELATIVE_BASE : (int) value - 1;
+        return true;
+    }
+
+    // Decimal number. Mantissas of up to 19 digits with small exponents are
+    // exact in double arithmetic (Clinger's fast path); anything else goes
+    // to strtod.
+    static bool parseDouble(const char *&p, const char *end, double& out) {
+        static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                       1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        skipSpace(p, end);
+        const char *start = p, *q = p;
+        bool negative = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+')) q++;
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool any = false;
+        for (; q < end && isDigit(*q); q++, any = true) {
+            if (digits < 19) mantissa = mantissa * 10 + (*q - '0'), digits += mantissa > 0;
+            else exponent++;
+        }
+        if (q < end && *q == '.') {
+            for (q++; q < end && isDigit(*q); q++, any = true) {
+                if (digits < 19) mantissa = mantissa * 10 + (*q - '0'), digits += mantissa > 0, exponent--;
+            }
+        }
+        if (!any)
+            return false;
+        if (q < end && (*q == 'e' || *q == 'E')) {
+            const char *e = q + 1;
+            bool exp_negative = e < end && *e == '-';
+            if (e < end && (*e == '-' || *e == '+')) e++;
+            if (e == end || !isDigit(*e))
+                return false;
+            int value = 0;
+            for (; e < end && isDigit(*e); e++)
+                value = std::min(value * 10 + (*e - '0'), 100000);
+            exponent += exp_negative ? -value : value;
+            q = e;
+        }
+        if (q < end && !isSpace(*q))
+            return false;
+        p = q;
+        if (mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+            double value = (double) mantissa;
+            value = exponent < 0 ? value / pow10[-exponent] : value * pow10[exponent];
+            out = negative ? -value : value;
+            return true;
+        }
+        char buffer[64];
+        int len = std::min((int) (q - start), 63);
+        memcpy(buffer, start, len);
+        buffer[len] = 0;
+        out = strtod(buffer, nullptr);
+        return true;
+    }
+
+    // Concatenate the chunks and turn the indices into absolute ones
+    static bool join(std::vector<ObjData>& parts, ObjData& out, const std::string& name) {
+        size_t nv = 0, nvt = 0, nvn = 0, nc = 0;
+        for (auto& part : parts) {
+            nv += part.v.size(), nvt += part.vt.size(), nvn += part.vn.size();
+            nc += part.corners.size();
+        }
+        if (parts.size() == 1) {
+            out = std::move(parts[0]);
+        } else {
+            out = ObjData();
+            out.v.reserve(nv), out.vt.reserve(nvt), out.vn.reserve(nvn);
+            out.corners.reserve(nc);
+        }
+        int base_v = 0, base_vt = 0, base_vn = 0;
+        for (auto& part : parts) {
+            if (parts.size() > 1) {
+                out.v.insert(out.v.end(), part.v.begin(), part.v.end());
+                out.vt.insert(out.vt.end(), part.vt.begin(), part.vt.end());
+                out.vn.insert(out.vn.end(), part.vn.begin(), part.vn.end());
+            }
+            size_t first = parts.size() > 1 ? out.corners.size() : 0;
+            if (parts.size() > 1)
+                out.corners.insert(out.corners.end(), part.corners.begin(), part.corners.end());
+            for (size_t i = first; i < out.corners.size(); i++) {
+                ObjIndex& c = out.corners[i];
+                if (!resolve(c.v, base_v, nv) || !resolve(c.vt, base_vt, nvt) || !resolve(c.vn, base_vn, nvn)) {
+                    printf("%s: face index out of range\n", name.c_str());
+                    return false;
+                }
+            }
+            base_v += part.v.size(), base_vt += part.vt.size(), base_vn += part.vn.size();
+            part = ObjData();
+        }
+        return true;
+    }
+
+    static bool resolve(int& index, int base, size_t count) {
+        if (index < -OBJ_RELATIVE_BASE / 2)
+            index += OBJ_RELATIVE_BASE + base;
+        else if (index == -1)
+            return true;
+        return index >= 0 && index < (long long) count;
+    }
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static void skipSpace(const char *&p, const char *end) {
+        while (p < end && isSpace(*p)) p++;
+    }
+};
+
+#endif // OBJ_PARSER_HPP_
@@ -5,6 +5,15 @@
 #include "common.hpp"
 #include "mat44.hpp"
 #include "vec.hpp"
+#include "aabb.hpp"
+#include "packet.hpp"
+
+// A point sampled on the surface of a light
+struct LightSample {
+    Vec3 p;
+    Vec3 normal;
+    double pdf; // with respect to solid angle at the shading point
+};
 
 // Base class for all 3d entities.
 class Object3D {
@@ -22,6 +31,56 @@ public:
     // Intersect Ray with this object. If hit, store information in hit structure.
     virtual bool intersect(const Ray &r, Hit &h, double tmin) = 0;
 
+    // Intersect the rays of p in mask, keeping the closer of their hits.
+    // Returns the lanes whose closest hit is now on this object. Objects
+    // with a hierarchy inside override this to traverse it with the packet.
+    virtual LaneMask intersectPacket(RayPacket &p, LaneMask mask) {
+        LaneMask hit = 0;
+        Hit h;
+        forEachLane(mask, [&](int i) {
+            h.t = p.t_max[i];
+            if (intersect(p.ray(i), h, p.t_min) && p.update(i, h))
+                hit |= laneBit(i);
+        });
+        return hit;
+    }
+
+    // Whether anything blocks r within (tmin, tmax). Only needs a yes or
+    // no, so overrides stop at the first hit and skip normals and uv.
+    virtual bool occluded(const Ray &r, double tmin, double tmax) {
+        Hit h;
+        return intersect(r, h, tmin) && h.t < tmax;
+    }
+
+    // World-space bounds of this object. Returns false for unbounded objects.
+    virtual bool getBounds(AABB &box) { return false; }
+
+    // Surface area, 0 for objects that cannot be sampled as lights.
+    virtual double area() { return 0; }
+
+    // Uniformly sample a point of the surface from u in [0, 1)^2.
+    virtual void samplePoint(const Vec3 &u, Vec3 &p, Vec3 &n) {}
+
+    // Sample a point of the surface that may light ref. By default the
+    // point is uniform in area and its pdf is converted to solid angle.
+    virtual bool sampleLight(const Vec3 &ref, const Vec3 &u, LightSample &ls) {
+        if (area() <= 0)
+            return false;
+        samplePoint(u, ls.p, ls.normal);
+        ls.pdf = lightPdf(ref, ls.p, ls.normal);
+        return ls.pdf > 0;
+    }
+
+    // Solid angle pdf of sampleLight(ref) returning point p with normal n
+    virtual double lightPdf(const Vec3 &ref, const Vec3 &p, const Vec3 &n) {
+        Vec3 d = p - ref;
+        double dist2 = d.len2();
+        double cos_light = fabs(n.dot(d)) / sqrt(dist2);
+        if (cos_light < 1e-9)
+            return 0;
+        return dist2 / (cos_light * area());
+    }
+
     inline double abs_f(double x) { return (x<0 ? -x : x);}
 
 };
@@ -59,6 +118,20 @@ public:
         return false;
     }
 
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        double t;
+        return crossing(r, t) && t > tmin && t < tmax;
+    }
+
+    // distance along r to the plane; false if r runs parallel to it
+    bool crossing(const Ray &r, double &t) {
+        double m = r.dir.dot(normal);
+        if (abs_f(m) < 1e-9)
+            return false;
+        t = (d - normal.dot(r.origin)) / m;
+        return true;
+    }
+
     // double solve(const Ray &r) {
     //     double s = d - normal.dot(r.origin);
     //     double t = s / normal.dot(r.dir);
@@ -80,21 +153,84 @@ public:
     ~Sphere() override = default;
 
     bool intersect(const Ray &r, Hit &h, double tmin) override {
-        // Calc dist from center to ray r
+        // solve |o + t*d - center|^2 = radius^2
         Vec3 originToCent = center - r.origin;
-        double d1 = abs_f(r.dir.normalized().dot(originToCent));
-        double d2 = originToCent.len2() - d1 * d1; // center to ray r
-        // Cals intersection
-        double interHalfLen = sqrt(radius*radius - d2);
-        double t = d1 - interHalfLen;
+        double a = r.dir.len2();
+        double b = r.dir.dot(originToCent);
+        double disc = b * b - a * (originToCent.len2() - radius * radius);
+        if (disc < 0) return false;
+        double interHalfLen = sqrt(disc);
+        // take the far root when the ray starts inside
+        double t = (b - interHalfLen) / a;
+        if (t < tmin) t = (b + interHalfLen) / a;
         if (t < tmin) return false;
-        else {
-            Vec3 normal = r.pointAtParameter(t) - center;
-            double u = 0.5 + atan2(normal.z, normal.x) / (2. * M_PI);
-            double v = 0.5 - asin(normal.y) / M_PI;
-            h.set(t, material, normal.normalized(), Vec3(u, v));
-            return true;
-        }
+        Vec3 normal = (r.pointAtParameter(t) - center).normalized();
+        double u = 0.5 + atan2(normal.z, normal.x) / (2. * M_PI);
+        double v = 0.5 - asin(normal.y) / M_PI;
+        // u turns around the y axis, v runs from the top to the bottom
+        double ring = sqrt(normal.x * normal.x + normal.z * normal.z);
+        Vec3 dpdu = Vec3(-normal.z, 0, normal.x) * (2 * M_PI * radius);
+        Vec3 dpdv = ring > 0 ? Vec3(normal.y * normal.x / ring, -ring, normal.y * normal.z / ring) * (M_PI * radius)
+                             : Vec3();
+        // the normal is (p - center) / radius
+        h.set(t, material, normal, Vec3(u, v), dpdu, dpdv, dpdu / radius, dpdv / radius);
+        return true;
+    }
+
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        Vec3 originToCent = center - r.origin;
+        double a = r.dir.len2();
+        double b = r.dir.dot(originToCent);
+        double disc = b * b - a * (originToCent.len2() - radius * radius);
+        if (disc < 0) return false;
+        double interHalfLen = sqrt(disc);
+        double t0 = (b - interHalfLen) / a, t1 = (b + interHalfLen) / a;
+        return (t0 > tmin && t0 < tmax) || (t1 > tmin && t1 < tmax);
+    }
+
+    bool getBounds(AABB &box) override {
+        box = AABB(center - radius, center + radius);
+        return true;
+    }
+
+    double area() override { return 4 * M_PI * radius * radius; }
+
+    void samplePoint(const Vec3 &u, Vec3 &p, Vec3 &n) override {
+        double z = 1 - 2 * u.x, r = sqrt(std::max(0., 1 - z * z)), phi = 2 * M_PI * u.y;
+        n = Vec3(r * cos(phi), r * sin(phi), z);
+        p = center + n * radius;
+    }
+
+    // From outside, sample the cone of directions the sphere covers
+    bool sampleLight(const Vec3 &ref, const Vec3 &u, LightSample &ls) override {
+        Vec3 w = center - ref;
+        double dist2 = w.len2();
+        if (dist2 <= radius * radius)
+            return Object3D::sampleLight(ref, u, ls);
+        double dist = sqrt(dist2);
+        w = w / dist;
+        double cos_max = sqrt(std::max(0., 1 - radius * radius / dist2));
+        double cos_theta = 1 - u.x * (1 - cos_max);
+        double sin_theta = sqrt(std::max(0., 1 - cos_theta * cos_theta));
+        double phi = 2 * M_PI * u.y;
+        Vec3 a = (fabs(w.x) > .1 ? Vec3(0, 1) : Vec3(1)).cross(w).normalized();
+        Vec3 b = w.cross(a);
+        Vec3 d = a * (cos(phi) * sin_theta) + b * (sin(phi) * sin_theta) + w * cos_theta;
+        // near intersection of ref + t*d, clamped for directions on the rim
+        double proj = dist * cos_theta;
+        double t = proj - sqrt(std::max(0., radius * radius - (dist2 - proj * proj)));
+        ls.p = ref + d * t;
+        ls.normal = (ls.p - center).normalized();
+        ls.pdf = 1 / (2 * M_PI * (1 - cos_max));
+        return true;
+    }
+
+    double lightPdf(const Vec3 &ref, const Vec3 &p, const Vec3 &n) override {
+        double dist2 = (center - ref).len2();
+        if (dist2 <= radius * radius)
+            return Object3D::lightPdf(ref, p, n);
+        double cos_max = sqrt(std::max(0., 1 - radius * radius / dist2));
+        return 1 / (2 * M_PI * (1 - cos_max));
     }
 };
 
@@ -113,10 +249,11 @@ class Transform : public Object3D {
 public:
     Object3D *o; //un-transformed object
     Mat44 transform;
+    Mat44 to_world; // inverse of transform
 
     Transform() {}
 
-    Transform(const Mat44& m, Object3D *obj): o(obj), transform(m.inversed()) {}
+    Transform(const Mat44& m, Object3D *obj): o(obj), transform(m.inversed()), to_world(m) {}
 
     ~Transform() {}
 
@@ -125,54 +262,144 @@ public:
         Vec3 trDirection = transformDirection(transform, r.dir);
         Ray tr(trSource, trDirection);
         bool inter = o->intersect(tr, h, tmin);
-        if (inter) {
-            h.normal = transformDirection(transform.transposed(),
-                h.normal).normalized();
-            // h.set(
-            //     h.t,
-            //     h.material,
-            //     transformDirection(transform.transposed(), h.normal).normalized(),
-            //     h.uv);
-        }
+        if (inter)
+            toWorld(h);
         return inter;
     }
+
+    // the packet moved into object space; t carries over unchanged
+    LaneMask intersectPacket(RayPacket &p, LaneMask mask) override {
+        RayPacket local;
+        local.clear(p.t_min);
+        int lane[PACKET_SIZE];
+        forEachLane(mask, [&](int i) {
+            lane[local.add(Ray(transformPoint(transform, p.origin[i]), transformDirection(transform, p.dir[i])),
+                           p.t_max[i])] = i;
+        });
+        local.finish();
+        LaneMask hit = 0;
+        forEachLane(o->intersectPacket(local, local.lanes()), [&](int k) {
+            toWorld(local.hits[k]);
+            if (p.update(lane[k], local.hits[k]))
+                hit |= laneBit(lane[k]);
+        });
+        return hit;
+    }
+
+    // move a hit of o from object space to world space
+    void toWorld(Hit &h) {
+        Mat44 normal_matrix = transform.transposed();
+        Vec3 n = transformDirection(normal_matrix, h.normal);
+        double n_len = n.len();
+        h.normal = n / n_len;
+        h.dpdu = transformDirection(to_world, h.dpdu);
+        h.dpdv = transformDirection(to_world, h.dpdv);
+        // the derivative of the normal, renormalized
+        auto normalDerivative = [&](const Vec3 &dn) {
+            Vec3 m = transformDirection(normal_matrix, dn);
+            return (m - h.normal * h.normal.dot(m)) / n_len;
+        };
+        h.dndu = normalDerivative(h.dndu);
+        h.dndv = normalDerivative(h.dndv);
+        // h.set(
+        //     h.t,
+        //     h.material,
+        //     transformDirection(transform.transposed(), h.normal).normalized(),
+        //     h.uv);
+    }
+
+    // the direction is not renormalized, so t carries over unchanged
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        Ray tr(transformPoint(transform, r.origin), transformDirection(transform, r.dir));
+        return o->occluded(tr, tmin, tmax);
+    }
+
+    bool getBounds(AABB &box) override {
+        AABB local;
+        if (!o->getBounds(local))
+            return false;
+        // transform the 8 corners back into world space
+        Mat44 m = transform.inversed();
+        box = AABB::empty();
+        for (int i = 0; i < 8; i++) {
+            Vec3 corner(i & 1 ? local.box_h.x : local.box_l.x,
+                        i & 2 ? local.box_h.y : local.box_l.y,
+                        i & 4 ? local.box_h.z : local.box_l.z);
+            box.expand(transformPoint(m, corner));
+        }
+        return true;
+    }
 };
 
 
+// Moller-Trumbore ray-triangle test on a triangle given by vertex v0 and the
+// edges e1 = v1 - v0, e2 = v2 - v0. On a hit in (tmin, tmax) returns the
+// distance t and the barycentric coordinates (u, v) of the hit point.
+inline bool intersectTriangle(const Ray &r, const Vec3 &v0, const Vec3 &e1, const Vec3 &e2,
+                              double tmin, double tmax, double &t, double &u, double &v) {
+    Vec3 pvec = r.dir.cross(e2);
+    double det = e1.dot(pvec);
+    if (det == 0)
+        return false;
+    double inv_det = 1. / det;
+    Vec3 tvec = r.origin - v0;
+    u = tvec.dot(pvec) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+    Vec3 qvec = tvec.cross(e1);
+    v = r.dir.dot(qvec) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = e2.dot(qvec) * inv_det;
+    return t > tmin && t < tmax;
+}
+
+// uniform point on the triangle v0, v0 + e1, v0 + e2
+inline Vec3 sampleTriangle(const Vec3 &u, const Vec3 &v0, const Vec3 &e1, const Vec3 &e2) {
+    double su = sqrt(u.x);
+    return v0 + e1 * (su * (1 - u.y)) + e2 * (su * u.y);
+}
+
 class Triangle: public Plane {
 public:
 	Vec3 vertices[3];
+    Vec3 e1, e2; // edges from vertices[0]
 
 	Triangle() = delete;
 
     // a b c are three vertex positions of the triangle
 	Triangle( const Vec3& a, const Vec3& b, const Vec3& c, Material* m) :
-        Plane(b-a.cross(c-a), a, m), vertices{a, b, c} {}
+        Plane((b-a).cross(c-a), a, m), vertices{a, b, c}, e1(b-a), e2(c-a) {}
 
 	bool intersect( const Ray& ray,  Hit& hit , double tmin) override {
-		// solve the intersection between ray and the triangle plane
-        Hit h_tmp;
-        if (Plane::intersect(ray, h_tmp, tmin)) {
-            Vec3 p = ray.pointAtParameter(h_tmp.t); // the intersection point
-
-            // determin if is inside the triangle
-            // using the Barycentric Technique
-            // see https://blackpawn.com/texts/pointinpoly/default.html
-            Vec3 v0 = vertices[2] - vertices[0];
-            Vec3 v1 = vertices[1] - vertices[0];
-            Vec3 v2 = p - vertices[0];
-            double denominator = v0.len2()*v1.len2() - v0.dot(v1)*v1.dot(v0);
-            double u = (v1.len2()*v2.dot(v0) - v1.dot(v0)*v2.dot(v1)) / denominator;
-            double v = (v0.len2()*v2.dot(v1) - v0.dot(v1)*v2.dot(v0)) / denominator;
-            if (good(u) && good(v) && good(u+v)) {
-                hit = h_tmp;
-                return true;
-            }
+        double t, u, v;
+        if (intersectTriangle(ray, vertices[0], e1, e2, tmin, INFINITY, t, u, v)) {
+            // uv holds the barycentric coordinates of the hit
+            hit.set(t, material, normal, Vec3(u, v), e1, e2);
+            return true;
         }
         return false;
 	}
+
+    bool occluded(const Ray &ray, double tmin, double tmax) override {
+        double t, u, v;
+        return intersectTriangle(ray, vertices[0], e1, e2, tmin, tmax, t, u, v);
+    }
 	
 	inline bool good(double x) { return (0 <= x && x <= 1); }
+
+    bool getBounds(AABB &box) override {
+        box = AABB(vertices[0], vertices[1]);
+        box.expand(vertices[2]);
+        return true;
+    }
+
+    double area() override { return e1.cross(e2).len() / 2; }
+
+    void samplePoint(const Vec3 &u, Vec3 &p, Vec3 &n) override {
+        p = sampleTriangle(u, vertices[0], e1, e2);
+        n = normal;
+    }
 };
 
 class Rectangle: public Plane {
@@ -193,14 +420,40 @@ public:
             Vec3 p_to_x = r.pointAtParameter(h_tmp.t) - p; // p -> point of intersection
             double du = p_to_x.dot(u) * u_len_inv;
             double dv = p_to_x.dot(v) * v_len_inv;
-            if (tmin < du && du < 1-tmin && tmin < dv && dv < 1-tmin) {
-                h.set(h_tmp.t, h_tmp.material, h_tmp.normal, Vec3(du, dv));
+            if (inside(du, dv, tmin)) {
+                h.set(h_tmp.t, h_tmp.material, h_tmp.normal, Vec3(du, dv), u / u_len_inv, v / v_len_inv);
                 return true;
             }
         }
         return false;
     }
 
+    // the same bounds as intersect, not the whole plane
+    bool occluded(const Ray& r, double tmin, double tmax) override {
+        double t;
+        if (!crossing(r, t) || !(t > tmin && t < tmax))
+            return false;
+        Vec3 p_to_x = r.pointAtParameter(t) - p;
+        return inside(p_to_x.dot(u) * u_len_inv, p_to_x.dot(v) * v_len_inv, tmin);
+    }
+
+    bool inside(double du, double dv, double tmin) const {
+        return tmin < du && du < 1-tmin && tmin < dv && dv < 1-tmin;
+    }
+
+    bool getBounds(AABB &box) override {
+        Vec3 du = u / u_len_inv, dv = v / v_len_inv;
+        box = AABB(p, p + du, p + dv, p + du + dv);
+        return true;
+    }
+
+    double area() override { return 1. / (u_len_inv * v_len_inv); }
+
+    void samplePoint(const Vec3 &s, Vec3 &x, Vec3 &n) override {
+        x = p + u * (s.x / u_len_inv) + v * (s.y / v_len_inv);
+        n = normal;
+    }
+
 };
 
 class Circle: public Plane {
@@ -209,17 +462,9 @@ public:
     Vec3 u, v;
 
     Circle(const Vec3& c, double r_, const Vec3& n, Material *m): Plane(n, c, m), r(r_) {
-        if (n.x < 1.0) {
-            u.x = n.z;
-            u.y = 0.;
-            u.z = -n.x;
-        } else {
-            u.x = 0.;
-            u.y = -n.z;
-            u.z = n.y;
-        }
-        u = u.normalized() * r;
-        v = n.cross(u).normalized() * r;
+        // orthogonal axes of the disk, each of length r
+        u = (fabs(normal.x) > .1 ? Vec3(0, 1) : Vec3(1)).cross(normal).normalized() * r;
+        v = normal.cross(u).normalized() * r;
     }
 
     bool intersect(const Ray& ray, Hit& h, double tmin) override {
@@ -234,6 +479,29 @@ public:
         }
         return false;
     }
+
+    // the same bounds as intersect, not the whole plane
+    bool occluded(const Ray& ray, double tmin, double tmax) override {
+        double t;
+        return crossing(ray, t) && t > tmin && t < tmax && (ray.pointAtParameter(t) - p).len() < r;
+    }
+
+    bool getBounds(AABB &box) override {
+        // extent of a disk along each axis is r * sin(angle to the normal)
+        Vec3 e(r * sqrt(std::max(0., 1 - normal.x * normal.x)),
+               r * sqrt(std::max(0., 1 - normal.y * normal.y)),
+               r * sqrt(std::max(0., 1 - normal.z * normal.z)));
+        box = AABB(p - e, p + e);
+        return true;
+    }
+
+    double area() override { return M_PI * r * r; }
+
+    void samplePoint(const Vec3 &s, Vec3 &x, Vec3 &n) override {
+        Vec3 d = Vec3::random_in_unit_disk(s);
+        x = p + u * d.x + v * d.y;
+        n = normal;
+    }
 };
 #endif
 
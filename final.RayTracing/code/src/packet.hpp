@@ -0,0 +1,159 @@
+#ifndef PACKET_HPP_
+#define PACKET_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "helpers.hpp"
+#include "aabb.hpp"
+#include "simd.hpp"
+
+// camera rays are traced together in blocks of this many pixels square
+#define PACKET_BLOCK 8
+#define PACKET_SIZE (PACKET_BLOCK * PACKET_BLOCK)
+
+// bit i of a lane mask stands for ray i of a packet
+typedef uint64_t LaneMask;
+
+inline LaneMask laneBit(int i) { return (LaneMask) 1 << i; }
+
+// Up to PACKET_SIZE rays traced through the same nodes together, each with
+// the closest hit found so far. Coordinates are kept structure-of-arrays
+// for the box kernels.
+struct RayPacket {
+    int count;
+    double t_min;
+    Vec3 origin[PACKET_SIZE], dir[PACKET_SIZE];
+    double o[3][PACKET_SIZE], inv_d[3][PACKET_SIZE];
+    double t_max[PACKET_SIZE]; // distance of hits[i], or of nothing yet
+    Hit hits[PACKET_SIZE];
+    Vec3 mean_dir; // orders the children of a node, for all rays at once
+
+    RayPacket() : count(0), t_min(0) {}
+
+    void clear(double tmin) {
+        count = 0;
+        t_min = tmin;
+    }
+
+    // append a ray with no hit yet, returns its lane
+    int add(const Ray& r, double t=1e38) {
+        int i = count++;
+        origin[i] = r.origin;
+        dir[i] = r.dir;
+        o[0][i] = r.origin.x, o[1][i] = r.origin.y, o[2][i] = r.origin.z;
+        inv_d[0][i] = 1. / r.dir.x, inv_d[1][i] = 1. / r.dir.y, inv_d[2][i] = 1. / r.dir.z;
+        t_max[i] = t;
+        hits[i] = Hit();
+        hits[i].t = t;
+        return i;
+    }
+
+    // call once all rays are in
+    void finish() {
+        mean_dir = Vec3();
+        for (int i = 0; i < count; i++)
+            mean_dir += dir[i];
+    }
+
+    LaneMask lanes() const { return count == PACKET_SIZE ? ~(LaneMask) 0 : laneBit(count) - 1; }
+
+    Ray ray(int i) const { return Ray(origin[i], dir[i]); }
+
+    // the hit of lane i is now h, if it is closer
+    bool update(int i, const Hit& h) {
+        if (!(h.t < t_max[i]))
+            return false;
+        hits[i] = h;
+        t_max[i] = h.t;
+        return true;
+    }
+};
+
+// Call f(i) for every lane i set in mask, in order
+template <class F>
+inline void forEachLane(LaneMask mask, F f) {
+    while (mask) {
+        int i = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        f(i);
+    }
+}
+
+// The lanes of mask whose rays enter box within (p.t_min, p.t_max[i]).
+// Every kernel gives exactly the answer of AABB::intersect, NaN slabs
+// included, so a packet visits whatever its rays would visit alone.
+inline LaneMask packetBoxScalar(const AABB& box, const RayPacket& p, LaneMask mask) {
+    LaneMask hit = 0;
+    double t_entry;
+    forEachLane(mask, [&](int i) {
+        Vec3 o(p.o[0][i], p.o[1][i], p.o[2][i]), inv_d(p.inv_d[0][i], p.inv_d[1][i], p.inv_d[2][i]);
+        if (box.intersect(o, inv_d, p.t_min, p.t_max[i], t_entry))
+            hit |= laneBit(i);
+    });
+    return hit;
+}
+
+#ifdef SIMD_X86
+inline LaneMask packetBoxSSE(const AABB& box, const RayPacket& p, LaneMask mask) {
+    const double lo[3] = {box.box_l.x, box.box_l.y, box.box_l.z}, hi[3] = {box.box_h.x, box.box_h.y, box.box_h.z};
+    const __m128d t_min0 = _mm_set1_pd(p.t_min);
+    LaneMask hit = 0;
+    for (int k = 0; k < p.count; k += 2) {
+        if (!((mask >> k) & 3))
+            continue;
+        __m128d t_min = t_min0, t_max = _mm_loadu_pd(&p.t_max[k]);
+        for (int a = 0; a < 3; a++) {
+            __m128d o = _mm_loadu_pd(&p.o[a][k]), inv_d = _mm_loadu_pd(&p.inv_d[a][k]);
+            __m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(lo[a]), o), inv_d);
+            __m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(hi[a]), o), inv_d);
+            // swap only where t0 > t1, which is false for NaN as in the scalar test
+            __m128d swap = _mm_cmpgt_pd(t0, t1);
+            __m128d near = _mm_or_pd(_mm_and_pd(swap, t1), _mm_andnot_pd(swap, t0));
+            __m128d far = _mm_or_pd(_mm_and_pd(swap, t0), _mm_andnot_pd(swap, t1));
+            // max and min return their second operand for NaN
+            t_min = _mm_max_pd(near, t_min);
+            t_max = _mm_min_pd(far, t_max);
+        }
+        hit |= (LaneMask) _mm_movemask_pd(_mm_cmple_pd(t_min, t_max)) << k;
+    }
+    return hit & mask;
+}
+
+__attribute__((target("avx2")))
+inline LaneMask packetBoxAVX2(const AABB& box, const RayPacket& p, LaneMask mask) {
+    const double lo[3] = {box.box_l.x, box.box_l.y, box.box_l.z}, hi[3] = {box.box_h.x, box.box_h.y, box.box_h.z};
+    const __m256d t_min0 = _mm256_set1_pd(p.t_min);
+    LaneMask hit = 0;
+    for (int k = 0; k < p.count; k += 4) {
+        if (!((mask >> k) & 15))
+            continue;
+        __m256d t_min = t_min0, t_max = _mm256_loadu_pd(&p.t_max[k]);
+        for (int a = 0; a < 3; a++) {
+            __m256d o = _mm256_loadu_pd(&p.o[a][k]), inv_d = _mm256_loadu_pd(&p.inv_d[a][k]);
+            __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(lo[a]), o), inv_d);
+            __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(hi[a]), o), inv_d);
+            __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+            __m256d near = _mm256_blendv_pd(t0, t1, swap);
+            __m256d far = _mm256_blendv_pd(t1, t0, swap);
+            t_min = _mm256_max_pd(near, t_min);
+            t_max = _mm256_min_pd(far, t_max);
+        }
+        hit |= (LaneMask) _mm256_movemask_pd(_mm256_cmp_pd(t_min, t_max, _CMP_LE_OQ)) << k;
+    }
+    return hit & mask;
+}
+#endif
+
+// Lanes past p.count are read but masked off; the arrays always hold
+// PACKET_SIZE entries, a multiple of every kernel width.
+inline LaneMask packetBox(const AABB& box, const RayPacket& p, LaneMask mask, SimdLevel level) {
+#ifdef SIMD_X86
+    if (level == SimdLevel::AVX2)
+        return packetBoxAVX2(box, p, mask);
+    if (level == SimdLevel::SSE)
+        return packetBoxSSE(box, p, mask);
+#endif
+    return packetBoxScalar(box, p, mask);
+}
+
+#endif // PACKET_HPP_
@@ -4,100 +4,522 @@
 #include "helpers.hpp"
 #include "vec.hpp"
 #include "mat44.hpp"
+#include "scheduler.hpp"
+#include "sampler.hpp"
+#include "adaptive.hpp"
+#include "film.hpp"
 #include "omp.h"
 
 #include "scene_parser.hpp"
 
 using namespace std;
 
-Vec3 radiance(const Ray &r, int depth, Group *group, unsigned short *Xi) {
-    if (depth >= 5) return Vec3();
+struct RenderOptions {
+    int samps;     // samples per subpixel, every pixel has 2x2 subpixels
+    int tile_size; // edge length of the square tiles handed to threads
+    SamplerType sampler;
+    int max_depth; // hard cap on the number of bounces
+    int rr_depth;  // bounces before russian roulette starts
+    bool nee;      // sample lights directly at diffuse hits
+    // adaptive sampling: stop a subpixel once its relative error is below
+    // adaptive_threshold (0 turns it off). Subpixels get adaptive_min
+    // samples per pass and at most adaptive_max in total; the frame spends
+    // at most as many samples as a uniform render with samps.
+    double adaptive_threshold;
+    int adaptive_min;
+    int adaptive_max;
+    int pass_samps; // progressive rendering: samples per subpixel and pass, 0 for one shot
+    // distributed rendering: only take samples [sample_offset, sample_offset
+    // + samps) of part tile_index of tile_count parts of the tile list
+    int sample_offset;
+    // samples per subpixel of the whole distributed render, which the
+    // sampler spreads its strata over; 0 for sample_offset + samps
+    int sample_total;
+    int tile_index, tile_count;
+    bool packets; // trace camera rays in packets of PACKET_BLOCK^2 pixels, not in adaptive renders
+    bool wavefront; // trace paths breadth first, a bounce of WAVEFRONT_SIZE paths at a time
 
-    Hit h;
-    Vec3 color;
-    if (group->intersect(r, h, eps)) {
-        //TODO : smallpt
-
-        Vec3 x = r.pointAtParameter(h.t);
-        Vec3 n = h.normal;
-        color = h.material->emission;
-        auto material_color = h.material->getColor(h.uv);
-        switch (h.material->type)
-        {
-            case MaterialType::DIFFUSE: {
+    RenderOptions(int samps_=80) :
+        samps(samps_), tile_size(32), sampler(SamplerType::OWEN), max_depth(64), rr_depth(5), nee(true),
+        adaptive_threshold(0), adaptive_min(4), adaptive_max(0), pass_samps(0),
+        sample_offset(0), sample_total(0), tile_index(0), tile_count(1), packets(false),
+        wavefront(false) {}
+};
 
-                auto diffuse = diffuseRay(r, h, Xi); //h.material->diffuseRay(r, h, Xi);
-                color += material_color * radiance(diffuse, depth+1, group, Xi);
-                break;
+// One light sample for a diffuse hit: what it brings unless something
+// lies on the shadow ray
+struct DirectSample {
+    Ray shadow;
+    double dist; // length of the shadow ray
+    Vec3 contrib;
+
+    DirectSample() : shadow(Vec3(), Vec3()), dist(0) {}
+};
+
+// Light arriving at x on a diffuse surface with normal n (facing the
+// incoming ray) from one light sample, weighted against BSDF sampling.
+// Returns false if the sample brings nothing, whatever the visibility.
+bool sampleDirect(const Scene &sc, const Vec3 &x, const Vec3 &n, Sampler &sampler, DirectSample &out) {
+    double pick_pdf;
+    Object3D *light = sc.lights.sample(sampler.get1D(), pick_pdf);
+    LightSample ls;
+    if (!light->sampleLight(x, sampler.get2D(), ls))
+        return false;
+    Vec3 d = ls.p - x;
+    double dist = d.len();
+    d = d / dist;
+    double cos_surface = n.dot(d);
+    if (cos_surface <= 0)
+        return false;
+    out.shadow = Ray(x, d);
+    out.dist = dist * (1 - 1e-6);
+    double light_pdf = pick_pdf * ls.pdf;
+    double bsdf_pdf = cos_surface / M_PI;
+    out.contrib = light->material->emission * (bsdf_pdf / light_pdf * powerHeuristic(light_pdf, bsdf_pdf));
+    return true;
+}
+
+// What a path carries from one bounce to the next
+struct PathState {
+    Vec3 throughput; // product of the surface colors so far
+    bool specular;   // last bounce was not sampled from a diffuse BSDF
+    double bsdf_pdf; // solid angle pdf of the last diffuse bounce
+
+    PathState() : throughput(1, 1, 1), specular(true), bsdf_pdf(0) {}
+};
+
+// Bounce depth of a path, at its hit h of ray: add the emission found there
+// to color and turn ray into the next ray. With opts.nee, a diffuse hit
+// also samples a light into direct, contribution times throughput, and
+// sets has_direct; the shadow ray is left to the caller. Past rr_depth the
+// path survives with a probability that follows throughput. Returns false
+// once the path ends.
+bool shadeHit(const Scene &sc, Sampler &sampler, const RenderOptions &opts, int depth,
+              RayDifferential &ray, Hit &h, PathState &path, Vec3 &color,
+              DirectSample &direct, bool &has_direct) {
+    bool nee = opts.nee && !sc.lights.empty();
+    has_direct = false;
+    Vec3 x = ray.pointAtParameter(h.t);
+    if (h.material->emission.max() > 0) {
+        double weight = 1;
+        if (nee && !path.specular) {
+            double light_pdf = sc.lights.pdf(h.object);
+            if (light_pdf > 0) {
+                light_pdf *= h.object->lightPdf(ray.origin, x, h.normal);
+                weight = powerHeuristic(path.bsdf_pdf, light_pdf);
             }
-            case MaterialType::SPECULAR: {
-                auto spec = specularRay(r, h);
-                color += material_color * radiance(spec, depth+1, group, Xi);
-                break;
+        }
+        color += path.throughput * h.material->emission * weight;
+    }
+    // textures filter over the footprint, mirrors and glass pass it on
+    if (h.material->texture || h.material->type != MaterialType::DIFFUSE)
+        h.computeDifferentials(ray);
+    path.throughput *= h.material->getColor(h);
+    switch (h.material->type)
+    {
+        case MaterialType::DIFFUSE: {
+            Vec3 n = h.normal.dot(ray.dir) > 0 ? -h.normal : h.normal;
+            if (nee && path.throughput.max() > 0 && sampleDirect(sc, x, n, sampler, direct)) {
+                direct.contrib = path.throughput * direct.contrib;
+                has_direct = true;
             }
-            case MaterialType::REFRACTIVE: {
-                //TODO: fix bug
-                auto rays = refractiveRay(r, h, Xi);
-                auto reflect = rays.first;
-                auto refract = rays.second;
-                double P = .25 + .5 * reflect.second;
-                double RP = reflect.second / P, TP = refract.second / (1 - P);
-                if (depth >= 2) {
-                    if (erand48(Xi) < P) {
-                        color += material_color * radiance(reflect.first, depth+1, group, Xi) * RP;
-                    } else {
-                        color += material_color * radiance(refract.first, depth+1, group, Xi) * TP;
+            ray = diffuseRay(ray, h, sampler);
+            path.bsdf_pdf = std::max(n.dot(ray.dir), 0.) / M_PI;
+            path.specular = false;
+            break;
+        }
+        case MaterialType::SPECULAR:
+            ray = specularRay(ray, h);
+            path.specular = true;
+            break;
+        case MaterialType::REFRACTIVE: {
+            // choose by the Fresnel term, so the weights cancel out
+            auto rays = refractiveRay(ray, h);
+            ray = sampler.get1D() < rays.first.second ? rays.first.first : rays.second.first;
+            path.specular = true;
+            break;
+        }
+    }
+
+    if (depth + 1 >= opts.rr_depth) {
+        double survive = std::min(path.throughput.max(), .95);
+        if (sampler.get1D() >= survive)
+            return false;
+        path.throughput /= survive;
+    }
+    return true;
+}
+
+// Trace one path iteratively, depth first: every bounce picks one
+// continuation, and light samples are tested right away. A primary hit
+// found beforehand, from a packet, replaces the first intersection; it has
+// no material on a miss.
+Vec3 radiance(const RayDifferential &r, const Scene &sc, Sampler &sampler, const RenderOptions &opts,
+              const Hit *primary=nullptr) {
+    Vec3 color;
+    RayDifferential ray = r;
+    PathState path;
+    DirectSample direct;
+    for (int depth = 0; depth < opts.max_depth; depth++) {
+        Hit h;
+        if (depth == 0 && primary != nullptr) {
+            if (primary->material == nullptr)
+                break;
+            h = *primary;
+        } else if (!sc.group->intersect(ray, h, eps)) {
+            break;
+        }
+        bool has_direct;
+        bool alive = shadeHit(sc, sampler, opts, depth, ray, h, path, color, direct, has_direct);
+        if (has_direct && !sc.group->occluded(direct.shadow, eps, direct.dist))
+            color += direct.contrib;
+        if (!alive)
+            break;
+    }
+    return color;
+}
+
+// Camera ray of sample s of subpixel (sx, sy) of pixel (x, y), through a tent filter
+RayDifferential cameraRay(const Scene& sp, Sampler& sampler, int x, int y, int sx, int sy, int s) {
+    // every subpixel is a pixel of its own to the sampler
+    sampler.startSample(2 * x + sx, 2 * y + sy, s);
+    Vec3 u = sampler.get2D();
+    double r1 = 2 * u.x, r2 = 2 * u.y;
+    double dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
+    double dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
+
+    Vec3 p((sx + .5 + dx) / 2 + x, (sy + .5 + dy) / 2 + y);
+    RayDifferential d = sp.camera->generateRayDifferential(p, sampler);
+    // the subpixels are half a pixel apart
+    d.scaleDifferentials(.5);
+    // Vec d = cx * (((sx + .5 + dx) / 2 + x) / w - .5) +
+    //         cy * (((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
+    return d;
+}
+
+// Radiance of sample s of subpixel (sx, sy) of pixel (x, y)
+Vec3 samplePixel(const Scene& sp, Sampler& sampler, int x, int y, int sx, int sy, int s,
+                 const RenderOptions& opts) {
+    return radiance(cameraRay(sp, sampler, x, y, sx, sy, s), sp, sampler, opts);
+}
+
+// One adaptive pass over a tile: the subpixels of every pixel that has not
+// converged get batch more samples each. The pixel is done once the error
+// of all its samples together drops below the threshold. Returns the
+// number of samples taken and counts the subpixels still going in active.
+long long renderTileAdaptive(const Scene& sp, Film& film, std::vector<SampleStats>& stats, const Tile& tile,
+                             const RenderOptions& opts, int batch, int max_samps, long long& active) {
+    int w = film.width;
+    auto sampler = makeSampler(opts.sampler, max_samps);
+    long long taken = 0;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            if (stats[2 * y * 2 * w + 2 * x].converged)
+                continue;
+            SampleStats pixel;
+            for (int sy = 0; sy < 2; sy++) {
+                for (int sx = 0; sx < 2; sx++) {
+                    SampleStats& st = stats[(2 * y + sy) * 2 * w + 2 * x + sx];
+                    int end = std::min(st.n + batch, max_samps);
+                    while (st.n < end) {
+                        Vec3 c = samplePixel(sp, *sampler, x, y, sx, sy, st.n, opts);
+                        st.add(c);
+                        film.add(x, y, c);
+                        taken++;
                     }
-                } else {
-                    // if (refract.second < eps) {
-                    //     color += material_color * radiance(reflect.first, depth+1, group, Xi);
-                    // } else {
-                        color += material_color * (radiance(reflect.first, depth+1, group, Xi) * reflect.second
-                            + radiance(refract.first, depth+1, group, Xi) * refract.second);
-                    // }
+                    pixel.merge(st);
                 }
             }
+            // a single pass is too few samples to trust the variance
+            bool converged = pixel.n >= 4 * max_samps || (pixel.n >= 8 * opts.adaptive_min
+                && pixel.relativeError() < opts.adaptive_threshold);
+            for (int sy = 0; sy < 2; sy++)
+                for (int sx = 0; sx < 2; sx++)
+                    stats[(2 * y + sy) * 2 * w + 2 * x + sx].converged = converged;
+            if (!converged)
+                active += 4;
         }
     }
-    return color;
+    return taken;
 }
 
-void renderFrame(const Scene& sp, Image& outImg, int samps) {
-    auto cam = sp.camera;
-    outImg.SetSize(cam->width, cam->height);
-    int w = cam->width, h = cam->height;
-
-    Group *group = sp.group;
-    
-    Vec3 r;
-    #pragma omp parallel for schedule(dynamic, 1) private(r)
-    for (int y = 0; y < h; y++)
-    { // Loop over image rows
-        fprintf(stderr, "\rRendering (%d spp) %5.2f%%", samps * 4, 100. * y / (h - 1));
-        for (unsigned short x = 0, Xi[3] = {0, 0, (unsigned short) (y*y*y)}; x < w; x++) {
-            outImg.SetPixel(x, y, Vec3());
-            for (int sy = 0; sy < 2; sy++) {      // 2x2 subpixel rows, i = index of pixels unrolled
-                for (int sx = 0; sx < 2; sx++) { // 2x2 subpixel cols
-                    r = Vec3();
-                    for (int s = 0; s < samps; s++) {
-                        double r1 = 2 * erand48(Xi), r2 = 2 * erand48(Xi);
-                        double dx = r1 < 1 ? sqrt(r1) - 1 : 1 - sqrt(2 - r1);
-                        double dy = r2 < 1 ? sqrt(r2) - 1 : 1 - sqrt(2 - r2);
-
-                        Vec3 p((sx + .5 + dx) / 2 + x, (sy + .5 + dy) / 2 + y);
-                        Ray d = cam->generateRay(p, Xi);
-                        // Vec d = cx * (((sx + .5 + dx) / 2 + x) / w - .5) +
-                        //         cy * (((sy + .5 + dy) / 2 + y) / h - .5) + cam.d;
-                        r += radiance(d, 0, group, Xi) * (1. / samps);
+// renderTilePass with the camera rays of every block of PACKET_BLOCK^2
+// pixels traced as one packet. The paths then go on one by one from the
+// hits. Every sample resumes the sampler where its camera ray left it,
+// and pixels get their samples in the same order, so the image is the
+// same.
+void renderTilePassPackets(const Scene& sp, Film& film, const Tile& tile, const RenderOptions& opts,
+                           Sampler& sampler, int first, int n) {
+    std::unique_ptr<RayPacket> packet(new RayPacket());
+    std::vector<RayDifferential> rays;
+    int dims[PACKET_SIZE];
+    for (int by = tile.y0; by < tile.y1; by += PACKET_BLOCK) {
+        for (int bx = tile.x0; bx < tile.x1; bx += PACKET_BLOCK) {
+            int x1 = std::min(bx + PACKET_BLOCK, tile.x1), y1 = std::min(by + PACKET_BLOCK, tile.y1);
+            for (int sy = 0; sy < 2; sy++)
+                for (int sx = 0; sx < 2; sx++)
+                    for (int s = first; s < first + n; s++) {
+                        packet->clear(eps);
+                        rays.clear();
+                        for (int y = by; y < y1; y++)
+                            for (int x = bx; x < x1; x++) {
+                                rays.push_back(cameraRay(sp, sampler, x, y, sx, sy, s));
+                                dims[packet->add(rays.back())] = sampler.dimension();
+                            }
+                        packet->finish();
+                        sp.group->intersectPacket(*packet, packet->lanes());
+                        int i = 0;
+                        for (int y = by; y < y1; y++)
+                            for (int x = bx; x < x1; x++, i++) {
+                                sampler.resumeSample(2 * x + sx, 2 * y + sy, s, dims[i]);
+                                film.add(x, y, radiance(rays[i], sp, sampler, opts, &packet->hits[i]));
+                            }
                     }
-                    outImg.IncrementPixel(x, y, Vec3(clamp(r.x), clamp(r.y), clamp(r.z)) * 0.25);
+        }
+    }
+}
+
+// paths in flight per thread in a wavefront render
+#define WAVEFRONT_SIZE (1 << 14)
+
+// The paths of a wavefront render, kept structure-of-arrays. queue lists
+// the paths still going, in the order the next stage takes them.
+struct Wavefront {
+    std::vector<RayDifferential> ray;
+    std::vector<Hit> hit;
+    std::vector<PathState> path;
+    std::vector<int> slot;          // where the path adds its color
+    std::vector<int> px, py, index; // the sample, to the sampler
+    std::vector<int> dim;           // dimensions used so far
+    std::vector<int> queue, next;
+    std::vector<DirectSample> shadow; // light samples of the last shade stage
+    std::vector<int> shadow_slot;
+
+    void clear() {
+        ray.clear(), hit.clear(), path.clear(), slot.clear();
+        px.clear(), py.clear(), index.clear(), dim.clear();
+        queue.clear();
+    }
+
+    // stable counting sort of queue by key(path) < buckets
+    template <class Key>
+    void sort(int buckets, Key key) {
+        int count[9] = {0};
+        for (int i : queue)
+            count[key(i) + 1]++;
+        for (int k = 1; k <= buckets; k++)
+            count[k] += count[k - 1];
+        next.resize(queue.size());
+        for (int i : queue)
+            next[count[key(i)]++] = i;
+        queue.swap(next);
+    }
+};
+
+inline int octant(const Vec3& d) { return (d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2; }
+
+// renderTilePass breadth first: the paths of up to WAVEFRONT_SIZE samples
+// go through every bounce together in stages. generate makes the camera
+// rays; extend intersects them, sorted by direction octant so neighbours
+// take the same way down the BVH; shade runs shadeHit, sorted by material
+// type; connect tests the shadow rays shade queued. A path picks up its
+// sampler where it left off, and sample colors go to the film in the
+// usual order, so the image is the same as depth first.
+void renderTilePassWavefront(const Scene& sp, Film& film, const Tile& tile, const RenderOptions& opts,
+                             Sampler& sampler, int first, int n) {
+    int w = tile.x1 - tile.x0, h = tile.y1 - tile.y0;
+    int total = w * h * 4 * n; // slots in (y, x, sy, sx, s) order
+    std::vector<Vec3> colors(total);
+    Wavefront wf;
+    for (int begin = 0; begin < total; begin += WAVEFRONT_SIZE) {
+        int end = std::min(begin + WAVEFRONT_SIZE, total);
+        // generate
+        wf.clear();
+        for (int k = begin; k < end; k++) {
+            int s = k % n, sub = k / n % 4, pixel = k / n / 4;
+            int x = tile.x0 + pixel % w, y = tile.y0 + pixel / w, sx = sub & 1, sy = sub >> 1;
+            wf.ray.push_back(cameraRay(sp, sampler, x, y, sx, sy, first + s));
+            wf.hit.push_back(Hit());
+            wf.path.push_back(PathState());
+            wf.slot.push_back(k);
+            wf.px.push_back(2 * x + sx), wf.py.push_back(2 * y + sy), wf.index.push_back(first + s);
+            wf.dim.push_back(sampler.dimension());
+            wf.queue.push_back(k - begin);
+        }
+        for (int depth = 0; depth < opts.max_depth && !wf.queue.empty(); depth++) {
+            // extend
+            wf.sort(8, [&](int i) { return octant(wf.ray[i].dir); });
+            wf.next.clear();
+            for (int i : wf.queue) {
+                wf.hit[i] = Hit();
+                if (sp.group->intersect(wf.ray[i], wf.hit[i], eps))
+                    wf.next.push_back(i);
+            }
+            wf.queue.swap(wf.next);
+            // shade
+            wf.sort(3, [&](int i) { return (int) wf.hit[i].material->type; });
+            wf.next.clear();
+            wf.shadow.clear();
+            wf.shadow_slot.clear();
+            DirectSample direct;
+            for (int i : wf.queue) {
+                sampler.resumeSample(wf.px[i], wf.py[i], wf.index[i], wf.dim[i]);
+                bool has_direct;
+                if (shadeHit(sp, sampler, opts, depth, wf.ray[i], wf.hit[i], wf.path[i], colors[wf.slot[i]],
+                             direct, has_direct))
+                    wf.next.push_back(i);
+                wf.dim[i] = sampler.dimension();
+                if (has_direct) {
+                    wf.shadow.push_back(direct);
+                    wf.shadow_slot.push_back(wf.slot[i]);
+                }
+            }
+            wf.queue.swap(wf.next);
+            // connect
+            for (size_t j = 0; j < wf.shadow.size(); j++)
+                if (!sp.group->occluded(wf.shadow[j].shadow, eps, wf.shadow[j].dist))
+                    colors[wf.shadow_slot[j]] += wf.shadow[j].contrib;
+        }
+    }
+    int k = 0;
+    for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++)
+            for (int j = 0; j < 4 * n; j++)
+                film.add(x, y, colors[k++]);
+}
+
+// Add samples [film.samples, film.samples + n) of every subpixel of tile,
+// counted from opts.sample_offset
+void renderTilePass(const Scene& sp, Film& film, const Tile& tile, const RenderOptions& opts, int n) {
+    auto sampler = makeSampler(opts.sampler, opts.sample_total > 0 ? opts.sample_total : opts.sample_offset + opts.samps);
+    int first = opts.sample_offset + film.samples;
+    if (opts.packets) {
+        renderTilePassPackets(sp, film, tile, opts, *sampler, first, n);
+        return;
+    }
+    if (opts.wavefront) {
+        renderTilePassWavefront(sp, film, tile, opts, *sampler, first, n);
+        return;
+    }
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int sy = 0; sy < 2; sy++)
+                for (int sx = 0; sx < 2; sx++)
+                    for (int s = first; s < first + n; s++)
+                        film.add(x, y, samplePixel(sp, *sampler, x, y, sx, sy, s, opts));
+        }
+    }
+}
+
+// Progressive rendering: bring film up to opts.samps samples per subpixel,
+// opts.pass_samps at a time, calling after_pass once each pass is in. A
+// film loaded from a checkpoint continues where it stopped, and ends up
+// exactly as if it had never been interrupted.
+void renderProgressive(const Scene& sp, Film& film, const RenderOptions& opts,
+                       const std::function<void(const Film&)>& after_pass) {
+    sp.group->build();
+    auto tiles = tileRange(makeTiles(film.width, film.height, opts.tile_size), opts.tile_index, opts.tile_count);
+    int n_threads = workerCount();
+    while (film.samples < opts.samps) {
+        int n = std::min(opts.pass_samps, opts.samps - film.samples);
+        TileScheduler sched(tiles, n_threads);
+        {
+            char label[64];
+            sprintf(label, "Pass %d/%d spp", 4 * (film.samples + n), 4 * opts.samps);
+            ProgressReporter reporter(sched, label);
+            #pragma omp parallel num_threads(n_threads)
+            {
+                int thread = workerId();
+                Tile tile;
+                while (sched.next(thread, tile)) {
+                    renderTilePass(sp, film, tile, opts, n);
+                    sched.finish(tile);
+                }
+            }
+        }
+        film.samples += n;
+        TextureCache::instance().collect();
+        after_pass(film);
+    }
+    TextureCache::instance().reportStats();
+}
+
+// Adaptive rendering in passes. Pass after pass, the pixels that are still
+// noisy get more samples, until all of them converged or the sample budget
+// of a uniform render is spent.
+void renderFrameAdaptive(const Scene& sp, Film& film, const RenderOptions& opts, Image* heatmap) {
+    int w = film.width, h = film.height;
+    int max_samps = opts.adaptive_max > 0 ? opts.adaptive_max : 4 * opts.samps;
+    std::vector<SampleStats> stats(4 * w * h);
+    long long budget = (long long) opts.samps * stats.size(), spent = 0;
+    long long active = stats.size();
+    auto tiles = makeTiles(w, h, opts.tile_size);
+    int n_threads = workerCount();
+    for (int pass = 0; active > 0; pass++) {
+        // the last passes share what is left of the budget
+        int batch = std::min((long long) opts.adaptive_min, (budget - spent) / active);
+        if (batch == 0)
+            break;
+        TileScheduler sched(tiles, n_threads);
+        long long taken = 0;
+        active = 0;
+        {
+            char label[64];
+            sprintf(label, "Adaptive pass %d (%.1f%% of budget)", pass + 1, 100. * spent / budget);
+            ProgressReporter reporter(sched, label);
+            #pragma omp parallel num_threads(n_threads) reduction(+:taken,active)
+            {
+                int thread = workerId();
+                Tile tile;
+                while (sched.next(thread, tile)) {
+                    taken += renderTileAdaptive(sp, film, stats, tile, opts, batch, max_samps, active);
+                    sched.finish(tile);
                 }
             }
         }
+        spent += taken;
+        TextureCache::instance().collect();
+    }
+    printf("Adaptive sampling: %.2f spp on average, %.1f%% of the budget\n",
+           4. * spent / stats.size(), 100. * spent / budget);
+    TextureCache::instance().reportStats();
+
+    if (heatmap) {
+        heatmap->SetSize(w, h);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                heatmap->SetPixel(x, y, heatmapColor(film.count[y * w + x] / (4. * max_samps)));
     }
 }
 
+// Render the whole frame into film in one go. With a heatmap, adaptive
+// renders also store the samples spent per pixel.
+void renderFrame(const Scene& sp, Film& film, const RenderOptions& opts, Image* heatmap=nullptr) {
+    if (opts.adaptive_threshold > 0) {
+        sp.group->build();
+        renderFrameAdaptive(sp, film, opts, heatmap);
+    } else {
+        // a progressive render with a single pass
+        RenderOptions single = opts;
+        single.pass_samps = opts.samps;
+        renderProgressive(sp, film, single, [](const Film&) {});
+    }
+#ifdef BVH_STATS
+    Mesh::reportStats();
+#endif
+}
+
+void renderFrame(const Scene& sp, Image& outImg, const RenderOptions& opts, Image* heatmap=nullptr) {
+    Film film(sp.camera->width, sp.camera->height);
+    renderFrame(sp, film, opts, heatmap);
+    film.resolve(outImg);
+}
+
+void renderFrame(const Scene& sp, Image& outImg, int samps) {
+    renderFrame(sp, outImg, RenderOptions(samps));
+}
+
 void renderFrame(const SceneParser& sp, Image& outImage, int sampls) {
     Scene sc(sp.camera, sp.group);
     renderFrame(sc, outImage, sampls);
-}
\ No newline at end of file
+}
@@ -0,0 +1,61 @@
+#!/usr/bin/env bash
+# Stand-in for a render farm on one machine: renders a frame as N parts in
+# separate processes, the way nodes would with their own disks, and merges
+# their films. Run from this directory after `make main merge`.
+#     ./render_local.sh [-n parts] [-m tiles|samples] output.bmp [main options...]
+# In tiles mode every part renders 1/N of the tiles with all samples; in
+# samples mode every part renders the whole frame with its own range of
+# --samples samples, so the result has N times the samples.
+set -e
+
+parts=4
+mode=tiles
+while getopts "n:m:" opt; do
+    case $opt in
+        n) parts=$OPTARG ;;
+        m) mode=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [[ $# -lt 1 ]]; then
+    echo "Usage: $0 [-n parts] [-m tiles|samples] output.bmp [main options...]"
+    exit 1
+fi
+output=$1
+shift
+
+samples=80
+args=("$@")
+for ((i = 0; i < ${#args[@]}; i++)); do
+    case ${args[i]} in
+        -s|--samples) samples=${args[i + 1]} ;;
+        --samples=*) samples=${args[i]#--samples=} ;;
+    esac
+done
+
+# the parts share the cores of this machine
+threads=$(( $(nproc) / parts ))
+((threads > 0)) || threads=1
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+pids=()
+for ((i = 0; i < parts; i++)); do
+    if [[ $mode == tiles ]]; then
+        part=(--tiles "$i/$parts")
+    else
+        part=(--sample-offset $((i * samples)) --sample-total $((parts * samples)))
+    fi
+    OMP_NUM_THREADS=$threads ./main "$@" "${part[@]}" --film "$dir/part$i.film" "$dir/part$i.bmp" \
+        > "$dir/part$i.log" 2>&1 &
+    pids+=($!)
+done
+for ((i = 0; i < parts; i++)); do
+    if ! wait "${pids[i]}"; then
+        echo "Part $i failed:"
+        cat "$dir/part$i.log"
+        exit 1
+    fi
+done
+./merge -o "$output" "$dir"/part*.film
@@ -8,40 +8,30 @@
 #include "aabb.hpp"
 #include <tuple>
 
-#define NEWTON_MAX_ITER 1000
+// halvings of the profile piece of a leaf row while isolating its roots
+#define REV_ROOT_DEPTH 12
+// Newton-bisection steps per root, enough to bisect down to 1e-19
+#define REV_ROOT_MAX_ITER 64
+// deep enough for a quad-tree over millions of leaves
+#define REV_STACK_SIZE 64
 
 struct RevSurface : public Object3D
 {
-    enum class NodeType {
-        LEAF,
-        INTERNAL
+    // Node of the quad-tree, 32 bytes. The children of a node are stored
+    // next to each other. Leaves are the cells of a grid with steps columns
+    // around the axis and points_cnt - 1 rows along the profile.
+    struct Node {
+        float box_l[3];
+        int first; // internal: index of the first child; leaf: row * steps + column
+        float box_h[3];
+        int count; // number of children, 0 for leaves
     };
-    struct Node
-    {
-        NodeType type;
-        Node* children[4];
-        // u[2]: theta_min, theta_max; v[2]: t_min, t_max
-        double u[2], v[2];
-        AABB box;
-
-        Node() {}
-        Node (Node* c1, Node* c2):
-            type(NodeType::INTERNAL), children{c1, c2, nullptr, nullptr},
-            box(c1->box, c2->box) {}
-        Node (Node* c1, Node* c2, Node* c3, Node* c4):
-            type(NodeType::INTERNAL), children{c1, c2, c3, c4},
-            box(c1->box, c2->box, c3->box, c4->box) {}
-        Node (double u0, double u1, double v0, double v1, const AABB& _box):
-            type(NodeType::LEAF), u{u0, u1}, v{v0, v1}, box(_box) {}
-    };
-    // TODO: extend to BSpline curve as well
     Curve *pCurve;
-    Node* nodes; // quad-tree
-    // AABB* boxes;
-    int root;
+    Node* nodes; // quad-tree, root first, 32 byte aligned
     int node_cnt;
     const int steps = 40;
     int points_cnt;
+    std::vector<double> row_s; // profile parameter at the edges of the rows
 
     RevSurface(Curve *pCurve, Material* material) : pCurve(pCurve), Object3D(material) {
         // Check flat.
@@ -54,20 +44,17 @@ struct RevSurface : public Object3D
         // discretize curve
         std::vector<CurvePoint> points;
         pCurve->discretize(30, points);
-
-        // create AABB quad-tree
-        int num_leaf = steps * (points.size() - 1);
-        int depth = log(num_leaf) / log(4) + 1;
-        int num_nodes = (pow(4, depth + 1) - 1) / 3;
-        // int leaf_start_pos = (pow(4, depth) - 1) / 3 + 1; // leaf start at index 0
-        nodes = new Node[num_nodes*4];
-        // boxes = new AABB[num_leaf];
-        node_cnt = 0;
         points_cnt = points.size();
-        for (unsigned int ci = 0; ci < points_cnt-1; ci++) {
+        int rows = points_cnt - 1;
+
+        // boxes of the leaves
+        std::vector<AABB> boxes(rows * steps);
+        for (int ci = 0; ci < points_cnt; ci++)
+            row_s.push_back(points[ci].t);
+        for (int ci = 0; ci < rows; ci++) {
             const CurvePoint& cp0 = points[ci];
             const CurvePoint& cp1 = points[ci+1];
-            for (unsigned int i = 0; i < steps; i++) {
+            for (int i = 0; i < steps; i++) {
                 double t[] = {
                     (double) i / steps * 2 * M_PI,
                     (double) ((i+1) % steps) / steps * 2 * M_PI
@@ -76,179 +63,397 @@ struct RevSurface : public Object3D
                     getPoint(cp0.V, t[0]), getPoint(cp0.V, t[1]),
                     getPoint(cp1.V, t[0]), getPoint(cp1.V, t[1])
                 };
-                nodes[node_cnt++] = Node(t[0], t[1], cp0.t, cp1.t,
-                                         AABB(vs[0], vs[1], vs[2], vs[3]));
+                // the corners miss the bulge of the arc between them
+                AABB box(vs[0], vs[1], vs[2], vs[3]);
+                double bulge = std::max(std::abs(cp0.V.x), std::abs(cp1.V.x)) * (1 - cos(M_PI / steps))
+                    + 1e-3 * (box.box_h - box.box_l).len();
+                box.box_l = box.box_l - Vec3(bulge, bulge, bulge);
+                box.box_h = box.box_h + Vec3(bulge, bulge, bulge);
+                boxes[ci*steps + i] = box;
             }
         }
-        root = createTree(0, steps+1, 0, points_cnt);
+
+        // create AABB quad-tree
+        node_cnt = countNodes(steps, rows);
+        void* memory = nullptr;
+        if (posix_memalign(&memory, 32, node_cnt * sizeof(Node)) != 0) {
+            printf("Cannot allocate the quad-tree of revSurface.\n");
+            exit(0);
+        }
+        nodes = (Node*) memory;
+        int next = 1;
+        createTree(0, 0, steps, 0, rows, boxes, next);
     }
 
-    // create tree node at index using boxes in [bottom..top][left..right]
-    int createTree(int left, int right, int bottom, int top) {
-        int width = right - left, height = top - bottom;
-        if (width == 1 && height == 1) { // leaf node
-            return bottom*steps + left;
-        }
-        if (width <= 2 && height <= 2) { // contains leaf node
-            if (width == 1)
-                nodes[node_cnt] = Node(
-                    &nodes[bottom*steps+left],
-                    &nodes[(bottom+1)*steps+left]);
-            else if (height == 1)
-                nodes[node_cnt] = Node(
-                    &nodes[bottom*steps+left],
-                    &nodes[bottom*steps+left+1]);
-            else
-                nodes[node_cnt] = Node(
-                    &nodes[bottom*steps+left],
-                    &nodes[bottom*steps+left+1],
-                    &nodes[(bottom+1)*steps+left],
-                    &nodes[(bottom+1)*steps+left+1]);
-            node_cnt++;
-            return node_cnt-1;
-        }
-        // contains internal nodes
-        if (width == 2) {
-            int h_mid = bottom + ((top - bottom) >> 1);
-            int c1 = createTree(left, right, bottom, h_mid); // bottom-left
-            int c2 = createTree(left, right, h_mid, top); // top-left
-            nodes[node_cnt] = Node(&nodes[c1], &nodes[c2]);
-            node_cnt++;
-            return node_cnt-1;
-        }
-        if (height == 2) {
-            int w_mid = left + ((right - left) >> 1);
-            int c1 = createTree(left, w_mid, bottom, top); // top-left
-            int c2 = createTree(w_mid, right, bottom, top); // bottom-right
-            nodes[node_cnt] = Node(&nodes[c1], &nodes[c2]);
-            node_cnt++;
-            return node_cnt-1;
-        }
-        // both > 2
-        int w_mid = left + ((right - left) >> 1);
-        int h_mid = bottom + ((top - bottom) >> 1);
-        int c1 = createTree(left, w_mid, bottom, h_mid); // bottom-left
-        int c2 = createTree(left, w_mid, h_mid, top); // top-left
-        int c3 = createTree(w_mid, right, bottom, h_mid); // bottom-right
-        int c4 = createTree(w_mid, right, h_mid, top); // top-right
-        nodes[node_cnt] = Node(&nodes[c1], &nodes[c2], &nodes[c3], &nodes[c4]);
-        node_cnt++;
-        return node_cnt-1;
+    RevSurface(const RevSurface&) = delete;
+    RevSurface& operator=(const RevSurface&) = delete;
+
+    // number of nodes of the tree over a width x height grid of leaves
+    static int countNodes(int width, int height) {
+        if (width == 1 && height == 1)
+            return 1;
+        int count = 1;
+        for (int w : {width / 2, width - width / 2})
+            for (int h : {height / 2, height - height / 2})
+                if (w > 0 && h > 0)
+                    count += countNodes(w, h);
+        return count;
+    }
+
+    // Fill nodes[index] with the tree over the leaves in [left, right) x
+    // [bottom, top); its children go to next onwards. Returns the bounds.
+    AABB createTree(int index, int left, int right, int bottom, int top,
+                    const std::vector<AABB>& boxes, int& next) {
+        Node& node = nodes[index];
+        AABB box;
+        if (right - left == 1 && top - bottom == 1) { // leaf node
+            node.first = bottom*steps + left;
+            node.count = 0;
+            box = boxes[node.first];
+        } else {
+            // halve both sides, those of length one stay whole
+            int xs[] = {left, left + ((right - left) >> 1), right};
+            int ys[] = {bottom, bottom + ((top - bottom) >> 1), top};
+            int cells[4][2], n = 0; // column and row half of every child
+            for (int i = 0; i < 2; i++)
+                for (int j = 0; j < 2; j++)
+                    if (xs[i] < xs[i+1] && ys[j] < ys[j+1])
+                        cells[n][0] = i, cells[n++][1] = j;
+            node.first = next;
+            node.count = n;
+            next += n;
+            for (int k = 0; k < n; k++) {
+                int i = cells[k][0], j = cells[k][1];
+                AABB child = createTree(node.first + k, xs[i], xs[i+1], ys[j], ys[j+1], boxes, next);
+                box = k == 0 ? child : AABB(box, child);
+            }
+        }
+        // round outwards, the float box must not be smaller
+        double lo[] = {box.box_l.x, box.box_l.y, box.box_l.z};
+        double hi[] = {box.box_h.x, box.box_h.y, box.box_h.z};
+        for (int i = 0; i < 3; i++) {
+            node.box_l[i] = (float) lo[i];
+            if (node.box_l[i] > lo[i])
+                node.box_l[i] = nextafterf(node.box_l[i], -INFINITY);
+            node.box_h[i] = (float) hi[i];
+            if (node.box_h[i] < hi[i])
+                node.box_h[i] = nextafterf(node.box_h[i], INFINITY);
+        }
+        return box;
     }
 
     ~RevSurface() override {
+        free(nodes);
         delete pCurve;
     }
 
+    bool getBounds(AABB &box) override {
+        // the curve stays inside the hull of its control points
+        double r = 0, y_min = INFINITY, y_max = -INFINITY;
+        for (const auto &cp : pCurve->getControls()) {
+            r = std::max(r, std::abs(cp.x));
+            y_min = std::min(y_min, cp.y);
+            y_max = std::max(y_max, cp.y);
+        }
+        box = AABB(Vec3(-r, -r, y_min), Vec3(r, r, y_max));
+        return true;
+    }
+
     // acquire point on surface with v rorated rad radians
     Vec3 getPoint(Vec3 v, double rad) {
         return Vec3(v.x*cos(rad), v.x*sin(rad), v.y);
     }
 
     bool intersect(const Ray &r, Hit &h, double tmin) override {
-        // intersect quad-tree, use (t_near + t_far) / 2 as estimate for t
-        auto result = intersect_tree(&nodes[root], r);
-        if (result.first == nullptr) {
+        double t, s, theta;
+        if (!solve(r, tmin, h.t, false, t, s, theta))
             return false;
+        Vec3 p, dp, ddp;
+        pCurve->powerBasis().evaluate(s, p, dp, ddp);
+        Vec3 du(-sin(theta)*p.x, cos(theta)*p.x, 0);
+        Vec3 dv(cos(theta)*dp.x, sin(theta)*dp.x, dp.y);
+        Vec3 normal = du.cross(dv);
+        // on the axis the tangent around it vanishes
+        normal = normal.len() > 0 ? normal.normalized() : Vec3(0, 0, dp.x < 0 ? 1 : -1);
+        // The normal turns about the axis with theta. Along the profile it is
+        // m = p.x * (cos dp.y, sin dp.y, -dp.x) normalized, with |m| = |p.x dp|.
+        Vec3 dndu = Vec3(-normal.y, normal.x, 0) * (2*M_PI), dndv;
+        double dp_len = dp.len();
+        if (p.x != 0 && dp_len > 0) {
+            Vec3 dm = Vec3(cos(theta)*ddp.y, sin(theta)*ddp.y, -ddp.x) * (p.x < 0 ? -1 : 1);
+            dndv = (dm - normal * normal.dot(dm)) / dp_len;
+        }
+        h.set(t, material, normal, Vec3(theta/(2*M_PI), s), du * (2*M_PI), dv, dndu, dndv);
+        return true;
+    }
+
+    bool occluded(const Ray &r, double tmin, double tmax) override {
+        double t, s, theta;
+        return solve(r, tmin, tmax, true, t, s, theta);
+    }
+
+    // The ray in the (radius^2, height) plane of the profile. Revolving
+    // removes theta: the ray meets the surface at profile parameter s iff
+    // it passes height y(s) at distance x(s) from the axis. Steep rays are
+    // followed by height, with t a function of y(s); shallow ones by the
+    // distance to the axis, with two branches for the way in and out.
+    struct RayProfile {
+        double a, b, c;   // squared distance to the axis is a t^2 + b t + c
+        double oz, dz;    // height is oz + dz t
+        bool steep;
+        double t_star;    // closest approach to the axis
+        double rho_min2;  // squared distance to the axis there
+
+        explicit RayProfile(const Ray &r) {
+            const Vec3 &o = r.origin, &d = r.dir;
+            a = d.x*d.x + d.y*d.y;
+            b = 2 * (o.x*d.x + o.y*d.y);
+            c = o.x*o.x + o.y*o.y;
+            oz = o.z, dz = d.z;
+            steep = dz*dz > a;
+            t_star = steep ? 0 : -b / (2*a);
+            rho_min2 = steep ? 0 : c - b*b / (4*a);
+        }
+
+        // g(s) for one branch (+1 or -1, unused when steep) and its
+        // derivative, zero at a hit; false where the branch does not exist
+        bool eval(const Vec3 &p, const Vec3 &dp, int branch, double &g, double &dg, double &t) const {
+            if (steep) {
+                t = (p.y - oz) / dz;
+                double dt = dp.y / dz;
+                g = (a*t + b)*t + c - p.x*p.x;
+                dg = (2*a*t + b)*dt - 2*p.x*dp.x;
+                return true;
+            }
+            double q = p.x*p.x - rho_min2;
+            if (q < 0)
+                return false;
+            double root = sqrt(q / a);
+            t = t_star + branch * root;
+            double dt = root > 0 ? branch * p.x*dp.x / (a*root) : 0;
+            g = p.y - oz - dz*t;
+            dg = dp.y - dz*dt;
+            return true;
         }
-        double t_near = result.second.first;
-        double t_far = result.second.second;
-        double t0 = (t_near + t_far) / 2;
-
-        // estimate u, v
-        Node* leaf = result.first;
-        double u0 = (leaf->u[0] + leaf->u[1]) / 2;
-        double v0 = (leaf->v[0] + leaf->v[1]) / 2;
-        // TODO: handle ray from inside the rev volume
-
-        // newton
-        auto v_bound = pCurve->get_valid_range();
-        auto x0 = Vec3(t0, u0, v0);
-        if (x0.z < v_bound.first || x0.z > v_bound.second) return false;
-        auto curvePoint = pCurve->evaluate(x0.z);
-        auto p = curvePoint.first;
-        auto dp = curvePoint.second;
-        auto realPoint = getPoint(p, x0.y);
-        auto f = r.pointAtParameter(x0.x) - realPoint;
-        auto dt = r.dir;
-        auto du = Vec3(-sin(x0.y)*p.x, cos(x0.y)*p.x, 0);
-        auto dv = Vec3(cos(x0.y)*dp.x, sin(x0.y)*dp.x, dp.y);
-        // { // check if derivatives are correct
-        //     double u2 = x0.y * (1 + 1e-5);
-        //     auto p2 = getPoint(p, u2);
-        //     auto du2 = (p2 - realPoint) / (u2 - x0.y);
-        //     double diff = (du2 - du).len();
-        //     assert(diff < 0.1);
-        //     double v2 = x0.z * (1 + 1e-5);
-        //     p2 = getPoint(pCurve->evaluate(v2).first, x0.y);
-        //     auto dv2 = (p2 - realPoint) / (v2 - x0.z);
-        //     diff = (dv2 - dv).len();
-        //     assert(diff < 0.1);
-        // }
-        // Mat44 jac = Mat44(dt, -du, -dv);
-        Mat44 jacobian_inv = Mat44(dt, -du, -dv).inversed();
-        // Mat44 id = jac.mult(jacobian_inv);
-        for (int i = 0; i < NEWTON_MAX_ITER; i++) {
-            //TODO: change limits
-            // if (f.max() < 1e-1 && f.min() > -1e-1) { // found intersection
-            if (f.max() < eps && f.min() > -eps && x0.x > tmin) { // found intersection
-                Vec3 normal = du.cross(dv).normalized();
-                h.set(x0.x, material, normal, Vec3(x0.y/(2*M_PI), x0.z));
+
+        // Bounds of g, its derivative and t over a part of the profile
+        // whose points and tangents lie in p and dp; false if the branch
+        // exists on none of it. dg is only bounded, and whole set, where
+        // the branch exists on all of it.
+        bool bound(const Interval p[2], const Interval dp[2], int branch,
+                   Interval &g, Interval &dg, Interval &t, bool &whole) const {
+            if (steep) {
+                t = (p[1] - Interval(oz)) * (1 / dz);
+                Interval dt = dp[1] * (1 / dz);
+                // a t^2 + b t + c as a square, which bounds it tighter
+                g = a > 0 ? (t + Interval(b / (2*a))).square() * a + Interval(c - b*b / (4*a)) - p[0].square()
+                          : Interval(c) - p[0].square();
+                dg = (t * (2*a) + Interval(b)) * dt - p[0] * dp[0] * 2;
+                whole = true;
                 return true;
-            // } else if (x0.y<leaf->u[0] || x0.y>leaf->u[1] || x0.z<leaf->v[0] || x0.z>leaf->v[1]) {
-            } else if (x0.x < -.05 || x0.y<0 || x0.y>=2*M_PI) { // very loose condition
+            }
+            Interval q = p[0].square() - Interval(rho_min2);
+            if (q.hi < 0)
                 return false;
+            whole = q.lo > 0;
+            Interval root(sqrt(std::max(q.lo, 0.) / a), sqrt(q.hi / a));
+            t = Interval(t_star) + root * branch;
+            g = p[1] - Interval(oz) - t * dz;
+            if (whole) {
+                Interval dt = p[0] * dp[0] * Interval(1 / (a * root.hi), 1 / (a * root.lo)) * branch;
+                dg = dp[1] - dt * dz;
+            }
+            return true;
+        }
+    };
+
+    // Closest hit in (tmin, tmax), or any hit if any_hit is set. Every row
+    // of the quad-tree leaves hit by r covers a piece of the profile; the
+    // rows are searched for roots in the order the ray enters them, until
+    // the next row starts behind the closest hit so far.
+    bool solve(const Ray &r, double tmin, double tmax, bool any_hit,
+               double &t_hit, double &s_hit, double &theta_hit) {
+        thread_local std::vector<std::pair<double, int>> leaves;
+        thread_local std::vector<int> rows;
+        rows.clear();
+        collectLeaves(r, tmin, tmax, leaves);
+
+        RayProfile profile(r);
+        t_hit = tmax;
+        bool hit = false;
+        for (auto &leaf : leaves) {
+            if (leaf.first > t_hit)
+                break;
+            int row = leaf.second / steps;
+            if (std::find(rows.begin(), rows.end(), row) != rows.end())
+                continue;
+            rows.push_back(row);
+            if (findRoot(profile, row_s[row], row_s[row+1], tmin, t_hit, s_hit)) {
+                hit = true;
+                if (any_hit)
+                    break;
+            }
+        }
+        if (!hit)
+            return false;
+        // the sign of the radius tells which side of the axis the point is on
+        Vec3 p = r.pointAtParameter(t_hit);
+        double radius = pCurve->evaluate(s_hit).first.x;
+        theta_hit = radius < 0 ? atan2(-p.y, -p.x) : atan2(p.y, p.x);
+        if (theta_hit < 0)
+            theta_hit += 2 * M_PI;
+        return true;
+    }
+
+    // Closest root on [s0, s1] with t in (tmin, t_best). The piece is
+    // bisected until every part either cannot hold a root closer than
+    // t_best or g is monotone on it, which leaves at most one root, found by
+    // bracketRoot. The tests bound g, its derivative and t over the part
+    // with interval arithmetic on the span polynomials. Parts where the
+    // branch only exists on some points, or where g is too flat to tell,
+    // are bracketed once they are 2^-REV_ROOT_DEPTH of the piece.
+    bool findRoot(const RayProfile &profile, double s0, double s1, double tmin,
+                  double &t_best, double &s_best) {
+        struct Part {
+            double lo, hi;
+            int depth;
+        };
+        // no root in v, with some slack for rounding
+        auto excludes = [](const Interval &v) {
+            double slack = 1e-9 * (fabs(v.lo) + fabs(v.hi));
+            return v.lo > slack || v.hi < -slack;
+        };
+        const PowerBasisCurve &curve = pCurve->powerBasis();
+        bool found = false;
+        for (int branch = -1; branch <= 1; branch += 2) {
+            if (profile.steep && branch > 0)
+                break;
+            // depth first, so at most one part per level waits
+            Part stack[REV_ROOT_DEPTH + 1];
+            int sp = 0;
+            stack[sp++] = {s0, s1, 0};
+            while (sp > 0) {
+                Part part = stack[--sp];
+                Interval p[2], dp[2], g, dg, t;
+                bool whole;
+                curve.bound(part.lo, part.hi, p, dp);
+                if (!profile.bound(p, dp, branch, g, dg, t, whole) || excludes(g)
+                    || t.hi <= tmin || t.lo >= t_best)
+                    continue;
+                if ((!whole || !excludes(dg)) && part.depth < REV_ROOT_DEPTH) {
+                    double mid = (part.lo + part.hi) / 2;
+                    stack[sp++] = {mid, part.hi, part.depth + 1};
+                    stack[sp++] = {part.lo, mid, part.depth + 1};
+                    continue;
+                }
+                if (bracketRoot(profile, branch, part.lo, part.hi, tmin, t_best, s_best))
+                    found = true;
             }
-            // iter
-            x0 = x0 - jacobian_inv.mult(f, false);
-            if (x0.z < v_bound.first || x0.z > v_bound.second) return false;
-            curvePoint = pCurve->evaluate(x0.z);
-            p = curvePoint.first;
-            dp = curvePoint.second;
-            realPoint = getPoint(p, x0.y);
-            f = r.pointAtParameter(x0.x) - realPoint;
-            du = Vec3(-sin(x0.y)*p.x, cos(x0.y)*p.x, 0);
-            dv = Vec3(cos(x0.y)*dp.x, sin(x0.y)*dp.x, dp.y);
-            jacobian_inv = Mat44(dt, -du, -dv).inversed();
+        }
+        return found;
+    }
+
+    // The root of g on [lo, hi], if its ends have opposite signs, when it
+    // is closer than t_best. It is narrowed by Newton steps that fall back
+    // to bisection whenever they leave the bracket, so it always converges.
+    bool bracketRoot(const RayProfile &profile, int branch, double lo, double hi, double tmin,
+                     double &t_best, double &s_best) {
+        double g_lo, g_hi, dg, t;
+        auto end_lo = pCurve->evaluate(lo), end_hi = pCurve->evaluate(hi);
+        bool ok_lo = profile.eval(end_lo.first, end_lo.second, branch, g_lo, dg, t);
+        bool ok_hi = profile.eval(end_hi.first, end_hi.second, branch, g_hi, dg, t);
+        if (!ok_lo && !ok_hi)
+            return false;
+        // move the missing end to where the branch starts
+        if (!ok_lo || !ok_hi) {
+            double &outside = ok_lo ? hi : lo;
+            double inside = ok_lo ? lo : hi;
+            for (int k = 0; k < REV_ROOT_MAX_ITER && fabs(outside - inside) > 1e-12; k++) {
+                double mid = (outside + inside) / 2;
+                Vec3 pm = pCurve->evaluate(mid).first;
+                (pm.x*pm.x >= profile.rho_min2 ? inside : outside) = mid;
+            }
+            outside = inside;
+            auto curvePoint = pCurve->evaluate(outside);
+            if (!profile.eval(curvePoint.first, curvePoint.second, branch, ok_lo ? g_hi : g_lo, dg, t))
+                return false;
+        }
+        if ((g_lo > 0) == (g_hi > 0))
+            return false;
+        double root = (lo + hi) / 2, g;
+        for (int k = 0; k < REV_ROOT_MAX_ITER; k++) {
+            auto curvePoint = pCurve->evaluate(root);
+            if (!profile.eval(curvePoint.first, curvePoint.second, branch, g, dg, t))
+                g = g_lo, dg = 0; // just outside, step towards the inside
+            if (g == 0)
+                break;
+            ((g > 0) == (g_lo > 0) ? lo : hi) = root;
+            double next = dg != 0 ? root - g / dg : lo;
+            if (!(next > lo && next < hi))
+                next = (lo + hi) / 2;
+            bool done = fabs(next - root) < 1e-12 * (1 + fabs(root));
+            root = next;
+            if (done)
+                break;
+        }
+        auto curvePoint = pCurve->evaluate(root);
+        if (profile.eval(curvePoint.first, curvePoint.second, branch, g, dg, t)
+            && t > tmin && t < t_best) {
+            t_best = t;
+            s_best = root;
+            return true;
         }
         return false;
     }
 
-    // returns <best_node, <t_near, t_far>>
-    std::pair<Node*, std::pair<double, double>> intersect_tree(
-        Node* node, const Ray& r) {
-            double t_near, t_far;
-            bool has_intersect = node->box.intersect(r, t_near, t_far);
-            if (!has_intersect) {
-                return {nullptr, {t_near, t_far}};
+    // All leaves hit by r in (tmin, tmax) as (entry distance, leaf index),
+    // sorted by entry distance. The tree is walked with a stack, nearest
+    // child first, so the leaves arrive almost in order.
+    void collectLeaves(const Ray& r, double tmin, double tmax,
+                       std::vector<std::pair<double, int>>& leaves) const {
+        leaves.clear();
+        float o[] = {(float) r.origin.x, (float) r.origin.y, (float) r.origin.z};
+        float inv_d[] = {1.f / (float) r.dir.x, 1.f / (float) r.dir.y, 1.f / (float) r.dir.z};
+        float t_min = tmin, t_max = tmax < FLT_MAX ? tmax : INFINITY;
+        int stack[REV_STACK_SIZE];
+        float stack_t[REV_STACK_SIZE]; // entry distance of the stacked nodes
+        int sp = 0;
+        if (boxHit(nodes[0], o, inv_d, t_min, t_max, stack_t[0]))
+            stack[sp++] = 0;
+        while (sp > 0) {
+            sp--;
+            const Node& node = nodes[stack[sp]];
+            if (node.count == 0) {
+                leaves.emplace_back(stack_t[sp], node.first);
+                continue;
             }
-            // has_intersect
-            if (node->type == NodeType::LEAF) {
-                return {node, {t_near, t_far}};
-            } else {
-                Node* res = nullptr;
-                has_intersect = false; // reuse
-                for (int i = 0; i < 4; i++) {
-                    if (node->children[i] != nullptr) {
-                        auto result = intersect_tree(node->children[i], r);
-                        if (result.first != nullptr) {
-                            // first intersection, or a closer intersection
-                            double tn = result.second.first;
-                            double tf = result.second.second;
-                            bool cond1 = t_near > 0 && tn > 0 && tn < t_near;
-                            bool cond2 = t_near < 0 && tn > 0;
-                            bool cond3 = t_near < 0 && tn < 0 && tf < t_far;
-                            if (!has_intersect || cond1 || cond2 || cond3) {
-                                res = result.first;
-                                t_near = tn;
-                                t_far = tf;
-                            }
-                        }
-                    }
-                }
-                return {res, {t_near, t_far}};
+            // push the children hit, farthest first
+            int top = sp;
+            for (int i = node.first; i < node.first + node.count; i++) {
+                float t;
+                if (!boxHit(nodes[i], o, inv_d, t_min, t_max, t))
+                    continue;
+                int j = sp++;
+                for (; j > top && stack_t[j-1] < t; j--)
+                    stack[j] = stack[j-1], stack_t[j] = stack_t[j-1];
+                stack[j] = i, stack_t[j] = t;
             }
         }
+        std::sort(leaves.begin(), leaves.end());
+    }
+
+    // slab test in float, clipped to [t_min, t_max]
+    static bool boxHit(const Node& node, const float o[3], const float inv_d[3],
+                       float t_min, float t_max, float& t_entry) {
+        for (int i = 0; i < 3; i++) {
+            float t0 = (node.box_l[i] - o[i]) * inv_d[i], t1 = (node.box_h[i] - o[i]) * inv_d[i];
+            if (t0 > t1) std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+        }
+        t_entry = t_min;
+        return t_min <= t_max;
+    }
 };
 
 #endif //REVSURFACE_HPP
@@ -0,0 +1,260 @@
+#ifndef SAMPLER_HPP_
+#define SAMPLER_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+
+// PCG32 random number generator, see https://www.pcg-random.org
+struct PCG32 {
+    uint64_t state, inc;
+
+    PCG32(uint64_t seed=0x853c49e6748fea9bULL, uint64_t seq=0xda3e39cb94b95bdbULL) {
+        seedWith(seed, seq);
+    }
+
+    void seedWith(uint64_t seed, uint64_t seq) {
+        state = 0;
+        inc = (seq << 1) | 1;
+        nextUInt();
+        state += seed;
+        nextUInt();
+    }
+
+    uint32_t nextUInt() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // uniform in [0, 1)
+    double nextDouble() { return nextUInt() * 2.3283064365386963e-10; }
+
+    // skip delta numbers in O(log delta) (Brown, "Random Number Generation
+    // with Arbitrary Stride", 1994)
+    void advance(uint64_t delta) {
+        uint64_t cur_mult = 6364136223846793005ULL, cur_plus = inc;
+        uint64_t acc_mult = 1, acc_plus = 0;
+        for (; delta > 0; delta >>= 1) {
+            if (delta & 1) {
+                acc_mult *= cur_mult;
+                acc_plus = acc_plus * cur_mult + cur_plus;
+            }
+            cur_plus = (cur_mult + 1) * cur_plus;
+            cur_mult *= cur_mult;
+        }
+        state = acc_mult * state + acc_plus;
+    }
+};
+
+// 32 bit integer hash (lowbias32 by Chris Wellons)
+inline uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v) {
+    return hash32(seed ^ (v + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+    x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the bits of x in base 2, after Burley, "Practical
+// Hash-based Owen Scrambling", JCGT 2020
+inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return reverseBits(x);
+}
+
+// first two dimensions of the Sobol sequence
+inline uint32_t sobol0(uint32_t index) { return reverseBits(index); }
+
+inline uint32_t sobol1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1U << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1) result ^= v;
+    return result;
+}
+
+inline double toUnit(uint32_t x) { return std::min(x * 2.3283064365386963e-10, 1. - 1e-16); }
+
+enum class SamplerType {
+    RANDOM,
+    STRATIFIED,
+    SOBOL,
+    OWEN
+};
+
+// Source of the random numbers for one path. Every value is a function of
+// (pixel, sample index, dimension) only, so an image comes out the same no
+// matter how pixels are spread over threads.
+class Sampler {
+public:
+    explicit Sampler(int spp_, uint32_t seed_=0) : spp(spp_), seed(seed_) {}
+
+    virtual ~Sampler() = default;
+
+    // Begin sample `index` of pixel (x, y); resets the dimension counter.
+    virtual void startSample(int x, int y, int index) {
+        pixel = hashCombine(hashCombine(seed, x), y);
+        sample = index;
+        dim = 0;
+    }
+
+    // Go on with sample `index` of pixel (x, y) from dimension d, as if
+    // nothing else had been sampled since it got there
+    virtual void resumeSample(int x, int y, int index, int d) {
+        startSample(x, y, index);
+        dim = d;
+    }
+
+    // dimensions the current sample has used
+    int dimension() const { return dim; }
+
+    // uniform in [0, 1)
+    virtual double get1D() = 0;
+
+    // uniform in [0, 1)^2, returned in x and y
+    virtual Vec3 get2D() {
+        double x = get1D();
+        return Vec3(x, get1D());
+    }
+
+protected:
+    int spp;
+    uint32_t seed;
+    uint32_t pixel;
+    int sample;
+    int dim;
+
+    uint32_t dimSeed(int d) const { return hashCombine(pixel, d); }
+};
+
+// Independent random numbers from a PCG32 stream per pixel sample
+class RandomSampler : public Sampler {
+public:
+    using Sampler::Sampler;
+
+    void startSample(int x, int y, int index) override {
+        Sampler::startSample(x, y, index);
+        rng.seedWith(((uint64_t) pixel << 32) | (uint32_t) index, pixel);
+    }
+
+    void resumeSample(int x, int y, int index, int d) override {
+        startSample(x, y, index);
+        rng.advance(d);
+        dim = d;
+    }
+
+    double get1D() override {
+        dim++;
+        return rng.nextDouble();
+    }
+
+private:
+    PCG32 rng;
+};
+
+// Every dimension is split into spp strata, visited in a per-pixel random
+// order with a random jitter inside the stratum (Latin hypercube sampling).
+class StratifiedSampler : public Sampler {
+public:
+    using Sampler::Sampler;
+
+    double get1D() override {
+        uint32_t s = dimSeed(dim++);
+        uint32_t stratum = permute(sample, spp, s);
+        return (stratum + toUnit(hash32(s ^ sample))) / spp;
+    }
+
+private:
+    // random permutation of [0, n) (Kensler, "Correlated Multi-Jittered
+    // Sampling", 2013)
+    static uint32_t permute(uint32_t i, uint32_t n, uint32_t p) {
+        // the cycle walk only comes back below n for i below n
+        assert(i < n);
+        uint32_t w = n - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p; i *= 0xe170893dU;
+            i ^= p >> 16; i ^= (i & w) >> 4;
+            i ^= p >> 8; i *= 0x0929eb3fU;
+            i ^= p >> 23; i ^= (i & w) >> 1;
+            i *= 1 | p >> 27; i *= 0x6935fa69U;
+            i ^= (i & w) >> 11; i *= 0x74dcb303U;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3U;
+            i ^= (i & w) >> 2; i *= 0xc860a3dfU;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= n);
+        return (i + p) % n;
+    }
+};
+
+// Sobol points handed out two dimensions at a time. Each pair of
+// dimensions shuffles the sample order with its own seed, so that pairs are
+// decorrelated. With owen set, the points are Owen scrambled per pixel;
+// otherwise they only get a random digital shift.
+class SobolSampler : public Sampler {
+public:
+    SobolSampler(int spp_, bool owen_, uint32_t seed_=0) : Sampler(spp_, seed_), owen(owen_) {}
+
+    double get1D() override {
+        uint32_t s = dimSeed(dim++);
+        uint32_t index = nestedUniformScramble(sample, s);
+        return scramble(sobol0(index), hash32(s));
+    }
+
+    Vec3 get2D() override {
+        uint32_t s = dimSeed(dim);
+        dim += 2;
+        uint32_t index = nestedUniformScramble(sample, s);
+        return Vec3(scramble(sobol0(index), hashCombine(s, 0)),
+                    scramble(sobol1(index), hashCombine(s, 1)));
+    }
+
+private:
+    bool owen;
+
+    double scramble(uint32_t x, uint32_t s) const {
+        return toUnit(owen ? nestedUniformScramble(x, s) : x ^ s);
+    }
+};
+
+inline std::unique_ptr<Sampler> makeSampler(SamplerType type, int spp, uint32_t seed=0) {
+    switch (type) {
+        case SamplerType::RANDOM: return std::unique_ptr<Sampler>(new RandomSampler(spp, seed));
+        case SamplerType::STRATIFIED: return std::unique_ptr<Sampler>(new StratifiedSampler(spp, seed));
+        case SamplerType::SOBOL: return std::unique_ptr<Sampler>(new SobolSampler(spp, false, seed));
+        default: return std::unique_ptr<Sampler>(new SobolSampler(spp, true, seed));
+    }
+}
+
+inline bool parseSamplerType(const std::string& name, SamplerType& type) {
+    const char* names[] = {"random", "stratified", "sobol", "owen"};
+    for (int i = 0; i < 4; i++) {
+        if (name == names[i]) {
+            type = (SamplerType) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif // SAMPLER_HPP_
@@ -374,6 +374,7 @@ public:
         assert(!strcmp(token, "}"));
 
         // return the group
+        answer->build();
         return answer;
     }
     Sphere *parseSphere()
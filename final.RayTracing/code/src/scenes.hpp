@@ -10,6 +10,7 @@
 #include "curve.hpp"
 #include "revsurface.hpp"
 #include "mesh.hpp"
+#include "lights.hpp"
 
 std::string textures[] = {
     
@@ -61,9 +62,11 @@ std::vector<Vec3> bspline_wineglass = {
 struct Scene {
     Camera* camera;
     Group* group; // group of all the objects
-    // Group lights; // group of lights
+    LightList lights; // emissive objects of group that can be sampled
 
-    Scene(Camera* c_, Group* g_): camera(c_), group(g_) {}
+    Scene(Camera* c_, Group* g_): camera(c_), group(g_) {
+        lights.build(group);
+    }
 };
 
 Scene getScene1() {
@@ -165,4 +168,33 @@ Scene getScene3() {
 
     return Scene(cam, g);
 }
+
+Scene getScene4() {
+    Group* g = new Group;
+    PerspectiveCamera* cam = new PerspectiveCamera(
+        Vec3(0, 0, 10),
+        Vec3(0, 0, -1),
+        Vec3(0, 1, 0),
+        600, 400, M_PI/3.2
+    );
+
+    // walls
+    g->addObject(new Plane(Vec3(1), Vec3(-10), &materials[0]));
+    g->addObject(new Plane(Vec3(-1), Vec3(10), &materials[0]));
+    g->addObject(new Plane(Vec3(0, 1), Vec3(0, -2), &materials[2]));
+    g->addObject(new Plane(Vec3(0,-1), Vec3(0, 10), &materials[3]));
+    g->addObject(new Plane(Vec3(0, 0, 1), Vec3(0, 0, -13), &materials[4]));
+    g->addObject(new Plane(Vec3(0, 0,-1), Vec3(0, 0, 10), &materials[1]));
+    // meshes
+    g->addObject(new Transform(
+        Mat44::translation(-2.5, 0, 0).mult(Mat44::scaling(2, 2, 2)),
+        new Mesh("./resources/horse.fine.90k.obj", &materials[0], MESH_SMOOTH_NORMALS)));
+    g->addObject(new Transform(
+        Mat44::translation(2.5, -2.6, 0).mult(Mat44::scaling(25, 25, 25)),
+        new Mesh("./resources/bunny.fine.obj", &materials[5], MESH_SMOOTH_NORMALS)));
+    // light
+    g->addObject(new Sphere(Vec3(0, 7, 7), 3.f, &materials[7]));
+
+    return Scene(cam, g);
+}
 #endif
\ No newline at end of file
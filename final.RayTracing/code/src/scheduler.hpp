@@ -0,0 +1,170 @@
+#ifndef SCHEDULER_HPP_
+#define SCHEDULER_HPP_
+
+#include "common.hpp"
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+inline int workerCount() { return omp_get_max_threads(); }
+inline int workerId() { return omp_get_thread_num(); }
+#else
+inline int workerCount() { return 1; }
+inline int workerId() { return 0; }
+#endif
+
+// Rectangle of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+
+    int pixels() const { return (x1 - x0) * (y1 - y0); }
+};
+
+// interleave the bits of x and y
+inline unsigned int mortonCode(unsigned int x, unsigned int y) {
+    unsigned int code = 0;
+    for (int i = 0; i < 16; i++) {
+        code |= ((x >> i) & 1u) << (2 * i);
+        code |= ((y >> i) & 1u) << (2 * i + 1);
+    }
+    return code;
+}
+
+// Cover a w x h image with tiles, listed in Morton order so that tiles
+// next to each other in the list are also close on screen.
+inline std::vector<Tile> makeTiles(int w, int h, int tile_size) {
+    int nx = (w + tile_size - 1) / tile_size, ny = (h + tile_size - 1) / tile_size;
+    std::vector<std::pair<unsigned int, Tile>> order;
+    for (int ty = 0; ty < ny; ty++) {
+        for (int tx = 0; tx < nx; tx++) {
+            Tile tile = {tx * tile_size, ty * tile_size,
+                         std::min(w, (tx + 1) * tile_size), std::min(h, (ty + 1) * tile_size)};
+            order.emplace_back(mortonCode(tx, ty), tile);
+        }
+    }
+    std::sort(order.begin(), order.end(),
+              [](const std::pair<unsigned int, Tile>& a, const std::pair<unsigned int, Tile>& b) {
+                  return a.first < b.first;
+              });
+    std::vector<Tile> tiles;
+    for (auto& t : order) tiles.push_back(t.second);
+    return tiles;
+}
+
+// Part index of count parts of tiles. The parts are contiguous runs of the
+// list, so with Morton ordered tiles every part is a compact region.
+inline std::vector<Tile> tileRange(const std::vector<Tile>& tiles, int index, int count) {
+    int n = tiles.size();
+    return std::vector<Tile>(tiles.begin() + (long long) n * index / count,
+                             tiles.begin() + (long long) n * (index + 1) / count);
+}
+
+// Hands out tiles to a fixed number of worker threads. Every worker starts
+// with a contiguous run of the Morton sequence in its own deque, takes work
+// from the front, and steals from the back of the other deques when its own
+// runs dry. Progress is tracked with atomic counters only.
+class TileScheduler {
+public:
+    std::vector<Tile> tiles;
+    std::atomic<long long> pixels_done;
+    std::atomic<int> tiles_done;
+    long long pixels_total;
+
+    TileScheduler(const std::vector<Tile>& tiles_, int n_threads) :
+        tiles(tiles_), pixels_done(0), tiles_done(0), pixels_total(0), queues(n_threads) {
+        int n = tiles.size();
+        for (int i = 0; i < n_threads; i++) {
+            for (int k = (long long) n * i / n_threads; k < (long long) n * (i + 1) / n_threads; k++)
+                queues[i].tiles.push_back(k);
+        }
+        for (auto& tile : tiles) pixels_total += tile.pixels();
+    }
+
+    // Get the next tile for worker thread; false once all tiles are taken.
+    bool next(int thread, Tile& tile) {
+        int id;
+        if (!queues[thread].popFront(id)) {
+            int n = queues.size();
+            bool stolen = false;
+            for (int i = 1; i < n && !stolen; i++)
+                stolen = queues[(thread + i) % n].popBack(id);
+            if (!stolen)
+                return false;
+        }
+        tile = tiles[id];
+        return true;
+    }
+
+    void finish(const Tile& tile) {
+        pixels_done += tile.pixels();
+        tiles_done++;
+    }
+
+    double progress() const {
+        return pixels_total ? (double) pixels_done / pixels_total : 1.;
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<int> tiles;
+
+        bool popFront(int& id) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty()) return false;
+            id = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+
+        bool popBack(int& id) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty()) return false;
+            id = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+    };
+
+    std::vector<WorkQueue> queues;
+};
+
+// Prints the progress of a scheduler from its own thread, so that workers
+// never touch stderr.
+class ProgressReporter {
+public:
+    ProgressReporter(const TileScheduler& sched_, const std::string& label_) :
+        sched(sched_), label(label_), finished(false) {
+        worker = std::thread([this]() {
+            while (!finished) {
+                print();
+                std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            }
+            print();
+            fprintf(stderr, "\n");
+        });
+    }
+
+    ~ProgressReporter() { stop(); }
+
+    void stop() {
+        if (worker.joinable()) {
+            finished = true;
+            worker.join();
+        }
+    }
+
+private:
+    const TileScheduler& sched;
+    std::string label;
+    std::atomic<bool> finished;
+    std::thread worker;
+
+    void print() {
+        fprintf(stderr, "\r%s %5.2f%%", label.c_str(), 100. * sched.progress());
+    }
+};
+
+#endif // SCHEDULER_HPP_
@@ -0,0 +1,148 @@
+#ifndef SIMD_HPP_
+#define SIMD_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define TRI_PACKET_WIDTH 8
+
+enum class SimdLevel {
+    SCALAR,
+    SSE,
+    AVX2
+};
+
+inline const char* simdLevelName(SimdLevel level) {
+    return level == SimdLevel::AVX2 ? "avx2" : level == SimdLevel::SSE ? "sse" : "scalar";
+}
+
+inline SimdLevel detectSimdLevel() {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    // the AVX2 kernels also use FMA, which some cpus and hypervisors lack
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+// widest instruction set of this cpu, may be lowered to compare code paths
+SimdLevel simd_level = detectSimdLevel();
+
+// Up to TRI_PACKET_WIDTH triangles in structure-of-arrays float layout.
+// Unused lanes have zero edges, which the kernels reject. std::vector does
+// not honour 32 byte alignment before C++17, so the kernels load unaligned.
+struct TrianglePacket {
+    float v0[3][TRI_PACKET_WIDTH];
+    float e1[3][TRI_PACKET_WIDTH];
+    float e2[3][TRI_PACKET_WIDTH];
+    int id[TRI_PACKET_WIDTH]; // triangle index of every lane
+
+    TrianglePacket() {
+        memset(this, 0, sizeof(TrianglePacket));
+    }
+};
+
+// Ray converted once to the float layout the kernels expect
+struct PacketRay {
+    float o[3], d[3];
+    float t_min, t_max;
+
+    // The float test runs with some slack so that it never misses a hit
+    // the exact double test would report; candidates are confirmed later.
+    PacketRay(const Vec3& origin, const Vec3& dir, double tmin, double tmax) :
+        o{(float) origin.x, (float) origin.y, (float) origin.z},
+        d{(float) dir.x, (float) dir.y, (float) dir.z},
+        t_min((float) tmin - 1e-3f), t_max((float) tmax * (1 + 1e-5f) + 1e-3f) {}
+};
+
+#define TRI_PACKET_UV_SLACK 1e-4f
+
+// Each kernel runs Moller-Trumbore on all lanes of a packet and returns a
+// bit mask of the lanes that may be hit within (t_min, t_max).
+#ifdef SIMD_X86
+inline int packetCandidatesSSE(const TrianglePacket& p, const PacketRay& r) {
+    int mask = 0;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 lo = _mm_set1_ps(-TRI_PACKET_UV_SLACK), hi = _mm_set1_ps(1 + TRI_PACKET_UV_SLACK);
+    const __m128 ox = _mm_set1_ps(r.o[0]), oy = _mm_set1_ps(r.o[1]), oz = _mm_set1_ps(r.o[2]);
+    const __m128 dx = _mm_set1_ps(r.d[0]), dy = _mm_set1_ps(r.d[1]), dz = _mm_set1_ps(r.d[2]);
+    const __m128 t_min = _mm_set1_ps(r.t_min), t_max = _mm_set1_ps(r.t_max);
+    for (int k = 0; k < TRI_PACKET_WIDTH; k += 4) {
+        __m128 e1x = _mm_loadu_ps(&p.e1[0][k]), e1y = _mm_loadu_ps(&p.e1[1][k]), e1z = _mm_loadu_ps(&p.e1[2][k]);
+        __m128 e2x = _mm_loadu_ps(&p.e2[0][k]), e2y = _mm_loadu_ps(&p.e2[1][k]), e2z = _mm_loadu_ps(&p.e2[2][k]);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv_det = _mm_div_ps(one, det);
+        __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&p.v0[0][k]));
+        __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&p.v0[1][k]));
+        __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&p.v0[2][k]));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+        // NaN lanes (det == 0) fail every ordered comparison
+        __m128 m = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(u, lo));
+        m = _mm_and_ps(m, _mm_cmpge_ps(v, lo));
+        m = _mm_and_ps(m, _mm_cmple_ps(_mm_add_ps(u, v), hi));
+        m = _mm_and_ps(m, _mm_cmpgt_ps(t, t_min));
+        m = _mm_and_ps(m, _mm_cmplt_ps(t, t_max));
+        mask |= _mm_movemask_ps(m) << k;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2,fma")))
+inline int packetCandidatesAVX2(const TrianglePacket& p, const PacketRay& r) {
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 lo = _mm256_set1_ps(-TRI_PACKET_UV_SLACK), hi = _mm256_set1_ps(1 + TRI_PACKET_UV_SLACK);
+    const __m256 dx = _mm256_set1_ps(r.d[0]), dy = _mm256_set1_ps(r.d[1]), dz = _mm256_set1_ps(r.d[2]);
+    __m256 e1x = _mm256_loadu_ps(p.e1[0]), e1y = _mm256_loadu_ps(p.e1[1]), e1z = _mm256_loadu_ps(p.e1[2]);
+    __m256 e2x = _mm256_loadu_ps(p.e2[0]), e2y = _mm256_loadu_ps(p.e2[1]), e2z = _mm256_loadu_ps(p.e2[2]);
+    __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_fmadd_ps(e1x, px, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1z, pz)));
+    __m256 inv_det = _mm256_div_ps(one, det);
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.o[0]), _mm256_loadu_ps(p.v0[0]));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.o[1]), _mm256_loadu_ps(p.v0[1]));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.o[2]), _mm256_loadu_ps(p.v0[2]));
+    __m256 u = _mm256_mul_ps(_mm256_fmadd_ps(tx, px, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tz, pz))), inv_det);
+    __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+    __m256 v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inv_det);
+    __m256 t = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz))), inv_det);
+    // NaN lanes (det == 0) fail every ordered comparison
+    __m256 m = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(u, lo, _CMP_GE_OQ));
+    m = _mm256_and_ps(m, _mm256_cmp_ps(v, lo, _CMP_GE_OQ));
+    m = _mm256_and_ps(m, _mm256_cmp_ps(_mm256_add_ps(u, v), hi, _CMP_LE_OQ));
+    m = _mm256_and_ps(m, _mm256_cmp_ps(t, _mm256_set1_ps(r.t_min), _CMP_GT_OQ));
+    m = _mm256_and_ps(m, _mm256_cmp_ps(t, _mm256_set1_ps(r.t_max), _CMP_LT_OQ));
+    return _mm256_movemask_ps(m);
+}
+#endif
+
+// Callers fall back to the scalar per-triangle test at SimdLevel::SCALAR.
+inline int packetCandidates(const TrianglePacket& p, const PacketRay& r, SimdLevel level) {
+#ifdef SIMD_X86
+    if (level == SimdLevel::AVX2)
+        return packetCandidatesAVX2(p, r);
+    return packetCandidatesSSE(p, r);
+#else
+    return 0;
+#endif
+}
+
+#endif // SIMD_HPP_
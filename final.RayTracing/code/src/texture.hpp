@@ -0,0 +1,406 @@
+#ifndef TEXTURE_HPP_
+#define TEXTURE_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include "scheduler.hpp"
+#ifndef STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#endif
+
+// texels are stored in square blocks of this size, 64 bytes each, in one or
+// two cache lines as std::vector does not align them
+#define TEXTURE_BLOCK 4
+// default memory budget of the texture cache, in bytes
+#define TEXTURE_CACHE_BUDGET (1024LL << 20)
+// threads with their own hit and miss counters; the rest share the last,
+// whose counts may then come out a little low
+#define TEXTURE_CACHE_COUNTERS 64
+
+enum class TextureWrap {
+    REPEAT,
+    CLAMP
+};
+
+enum class TextureFilter {
+    NEAREST,   // level 0, the texel under the point
+    BILINEAR,  // the nearest mip level, bilinear within it
+    TRILINEAR  // bilinear in the two levels around the footprint, blended
+};
+
+// One level of a mip pyramid. Texels are RGBA8 packed into 32 bits and
+// stored in 4x4 blocks, row by row, so the four texels of a bilinear
+// lookup are in one block, or in two or four neighbouring ones where the
+// footprint crosses a block edge, however the texture is walked.
+struct MipLevel {
+    int width, height;
+    int blocks_x; // blocks per row
+    std::vector<uint32_t> texels;
+
+    MipLevel(int w, int h) :
+        width(w), height(h), blocks_x((w + TEXTURE_BLOCK - 1) / TEXTURE_BLOCK),
+        texels(blocks_x * ((h + TEXTURE_BLOCK - 1) / TEXTURE_BLOCK) * TEXTURE_BLOCK * TEXTURE_BLOCK) {}
+
+    int index(int x, int y) const {
+        int block = (y / TEXTURE_BLOCK) * blocks_x + x / TEXTURE_BLOCK;
+        return block * TEXTURE_BLOCK * TEXTURE_BLOCK + (y % TEXTURE_BLOCK) * TEXTURE_BLOCK + x % TEXTURE_BLOCK;
+    }
+
+    uint32_t get(int x, int y) const { return texels[index(x, y)]; }
+    void set(int x, int y, uint32_t texel) { texels[index(x, y)] = texel; }
+};
+
+inline uint32_t packTexel(int r, int g, int b) {
+    return r | g << 8 | b << 16 | 0xffu << 24;
+}
+
+inline Vec3 unpackTexel(uint32_t texel) {
+    return Vec3(texel & 0xff, (texel >> 8) & 0xff, (texel >> 16) & 0xff) / 255.;
+}
+
+// An image with its mip pyramid down to 1x1. Texture coordinates run from
+// (0, 0) at the top left of the image to (1, 1) at the bottom right.
+class Texture {
+public:
+    TextureWrap wrap;
+    TextureFilter filter;
+    std::vector<MipLevel> levels;
+
+    Texture() : wrap(TextureWrap::REPEAT), filter(TextureFilter::TRILINEAR) {}
+
+    bool load(const std::string& path) {
+        int w, h, c;
+        unsigned char* data = stbi_load(path.c_str(), &w, &h, &c, 3);
+        if (data == nullptr) {
+            printf("Cannot load texture %s\n", path.c_str());
+            return false;
+        }
+        build(data, w, h);
+        stbi_image_free(data);
+        return true;
+    }
+
+    // Level 0 from 8 bit RGB rows, top row first, and the levels below it
+    // by averaging 2x2 texels
+    void build(const unsigned char* rgb, int w, int h) {
+        levels.clear();
+        levels.emplace_back(w, h);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                const unsigned char* p = rgb + 3 * (y * w + x);
+                levels[0].set(x, y, packTexel(p[0], p[1], p[2]));
+            }
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const MipLevel& src = levels.back();
+            MipLevel dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+            for (int y = 0; y < dst.height; y++) {
+                for (int x = 0; x < dst.width; x++) {
+                    int sum[3] = {};
+                    for (int k = 0; k < 4; k++) {
+                        // odd sizes repeat the last row or column
+                        uint32_t t = src.get(std::min(2 * x + (k & 1), src.width - 1),
+                                             std::min(2 * y + (k >> 1), src.height - 1));
+                        for (int c = 0; c < 3; c++)
+                            sum[c] += (t >> (8 * c)) & 0xff;
+                    }
+                    dst.set(x, y, packTexel((sum[0] + 2) / 4, (sum[1] + 2) / 4, (sum[2] + 2) / 4));
+                }
+            }
+            levels.push_back(std::move(dst));
+        }
+    }
+
+    bool empty() const { return levels.empty(); }
+    int width() const { return levels[0].width; }
+    int height() const { return levels[0].height; }
+
+    size_t bytes() const {
+        size_t sum = 0;
+        for (auto& level : levels)
+            sum += level.texels.size() * sizeof(uint32_t);
+        return sum;
+    }
+
+    // Color at uv for a footprint spanned by duvdx and duvdy, the change in
+    // uv from one pixel to the next. Without a footprint the finest level
+    // is used.
+    Vec3 sample(const Vec3& uv, const Vec3& duvdx=Vec3(), const Vec3& duvdy=Vec3()) const {
+        return sample(uv, duvdx, duvdy, filter, wrap);
+    }
+
+    // the same with other filter and wrap modes than the texture's own
+    Vec3 sample(const Vec3& uv, const Vec3& duvdx, const Vec3& duvdy,
+                TextureFilter filter, TextureWrap wrap) const {
+        if (filter == TextureFilter::NEAREST)
+            return unpackTexel(levels[0].get(wrapCoord((int) floor(uv.x * width()), width(), wrap),
+                                             wrapCoord((int) floor(uv.y * height()), height(), wrap)));
+        // footprint in texels of level 0
+        double fx = std::hypot(duvdx.x * width(), duvdx.y * height());
+        double fy = std::hypot(duvdy.x * width(), duvdy.y * height());
+        double footprint = std::max(fx, fy);
+        double lod = footprint > 1 ? log2(footprint) : 0;
+        lod = std::min(lod, (double) levels.size() - 1);
+        if (filter == TextureFilter::BILINEAR)
+            return bilinear(levels[(int) (lod + .5)], uv, wrap);
+        int l0 = (int) lod;
+        double f = lod - l0;
+        if (f == 0)
+            return bilinear(levels[l0], uv, wrap);
+        return bilinear(levels[l0], uv, wrap) * (1 - f) + bilinear(levels[l0 + 1], uv, wrap) * f;
+    }
+
+private:
+    static int wrapCoord(int i, int n, TextureWrap wrap) {
+        if (wrap == TextureWrap::CLAMP)
+            return std::max(0, std::min(i, n - 1));
+        i %= n;
+        return i < 0 ? i + n : i;
+    }
+
+    static Vec3 bilinear(const MipLevel& level, const Vec3& uv, TextureWrap wrap) {
+        double x = uv.x * level.width - .5, y = uv.y * level.height - .5;
+        double x0 = floor(x), y0 = floor(y);
+        double fx = x - x0, fy = y - y0;
+        int xs[] = {wrapCoord((int) x0, level.width, wrap), wrapCoord((int) x0 + 1, level.width, wrap)};
+        int ys[] = {wrapCoord((int) y0, level.height, wrap), wrapCoord((int) y0 + 1, level.height, wrap)};
+        return (unpackTexel(level.get(xs[0], ys[0])) * (1 - fx) + unpackTexel(level.get(xs[1], ys[0])) * fx) * (1 - fy)
+            + (unpackTexel(level.get(xs[0], ys[1])) * (1 - fx) + unpackTexel(level.get(xs[1], ys[1])) * fx) * fy;
+    }
+};
+
+class TextureHandle;
+
+// Textures shared by every material of the process, one per path. They are
+// loaded when first sampled and kept within a memory budget by collect(),
+// which the renderer calls between passes: it evicts whole textures, not
+// tiles of them, used least recently, which are loaded again if they are
+// sampled later. Renders
+// sample without locking, so nothing is freed during a pass; a pass that
+// samples more textures than the budget holds goes over it, but never
+// loads one twice.
+class TextureCache {
+public:
+    struct Stats {
+        long long hits;   // samples of a resident texture
+        long long misses; // samples that had to load their texture
+        long long loads, evictions;
+        size_t resident_bytes, peak_bytes; // every texture not freed yet
+    };
+
+    static TextureCache& instance() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    // a handle to the texture at path; nothing is read yet
+    TextureHandle get(const std::string& path);
+
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+    }
+
+    // free the textures no handle refers to any more, then evict down to
+    // the budget; no thread may be sampling
+    void collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto texture : retired) {
+            resident -= texture->bytes();
+            delete texture;
+        }
+        retired.clear();
+        while (resident > budget) {
+            Entry* victim = nullptr;
+            for (auto& entry : entries) {
+                Entry* e = entry.second;
+                if (e->texture.load(std::memory_order_relaxed) != nullptr
+                    && (victim == nullptr || e->last_use.load() < victim->last_use.load()))
+                    victim = e;
+            }
+            if (victim == nullptr)
+                break;
+            delete victim->texture.load(std::memory_order_relaxed);
+            victim->texture.store(nullptr, std::memory_order_relaxed);
+            resident -= victim->bytes;
+            evictions++;
+        }
+        clock++; // later samples count as more recent
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s = {0, 0, loads, evictions, resident, peak};
+        for (auto& c : counters) {
+            s.hits += c.hits.load(std::memory_order_relaxed);
+            s.misses += c.misses.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    void reportStats() {
+        Stats s = stats();
+        if (s.hits + s.misses == 0)
+            return;
+        printf("Texture cache: %lld hits, %lld misses, %lld loads, %lld evictions, "
+               "%.1f MB resident (peak %.1f MB of %.1f MB)\n", s.hits, s.misses, s.loads, s.evictions,
+               s.resident_bytes / 1048576., s.peak_bytes / 1048576., budget / 1048576.);
+    }
+
+private:
+    friend class TextureHandle;
+
+    struct Entry {
+        std::string path;
+        int refs;
+        std::atomic<const Texture*> texture; // null until loaded and once evicted
+        std::atomic<long long> last_use;     // clock at the last sample
+        size_t bytes;
+        std::atomic<bool> failed; // could not be loaded, not tried again
+    };
+
+    // Written by their own thread only, so counting needs no locked
+    // instruction
+    struct Counters {
+        std::atomic<long long> hits, misses;
+        void count(std::atomic<long long>& n) { n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        char pad[64 - 2 * sizeof(std::atomic<long long>)]; // one cache line per thread
+    };
+
+    std::mutex mutex;
+    std::map<std::string, Entry*> entries;
+    std::vector<const Texture*> retired;
+    size_t budget, resident, peak;
+    long long loads, evictions;
+    std::atomic<long long> clock; // counts loads and collections, orders the uses
+    Counters counters[TEXTURE_CACHE_COUNTERS];
+
+    TextureCache() : budget(TEXTURE_CACHE_BUDGET), resident(0), peak(0), loads(0), evictions(0), clock(0) {
+        for (auto& c : counters)
+            c.hits = 0, c.misses = 0;
+    }
+
+    ~TextureCache() {
+        collect();
+        for (auto& e : entries) {
+            delete e.second->texture.load();
+            delete e.second;
+        }
+    }
+
+    // The texture of e, loaded if it is not resident; null if it cannot be
+    // loaded. Only a miss takes the lock.
+    const Texture* acquire(Entry* e) {
+        Counters& c = counters[std::min(workerId(), TEXTURE_CACHE_COUNTERS - 1)];
+        long long now = clock.load(std::memory_order_relaxed);
+        if (e->last_use.load(std::memory_order_relaxed) != now)
+            e->last_use.store(now, std::memory_order_relaxed);
+        const Texture* texture = e->texture.load(std::memory_order_acquire);
+        if (texture != nullptr) {
+            c.count(c.hits);
+            return texture;
+        }
+        c.count(c.misses);
+        if (e->failed.load(std::memory_order_relaxed))
+            return nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        texture = e->texture.load(std::memory_order_relaxed);
+        if (texture != nullptr || e->failed)
+            return texture; // another thread got here first
+        Texture* loaded = new Texture();
+        if (!loaded->load(e->path)) {
+            delete loaded;
+            e->failed = true;
+            return nullptr;
+        }
+        e->bytes = loaded->bytes();
+        resident += e->bytes;
+        peak = std::max(peak, resident);
+        loads++;
+        e->last_use.store(clock.fetch_add(1) + 1, std::memory_order_relaxed);
+        e->texture.store(loaded, std::memory_order_release);
+        return loaded;
+    }
+
+    void retain(Entry* e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        e->refs++;
+    }
+
+    // forget e once no handle is left
+    void release(Entry* e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--e->refs > 0)
+            return;
+        const Texture* texture = e->texture.load(std::memory_order_relaxed);
+        if (texture != nullptr)
+            retired.push_back(texture); // still counted until collect()
+        entries.erase(e->path);
+        delete e;
+    }
+};
+
+// Reference counted handle to a texture of the cache, with the filter and
+// wrap modes of its user. Empty handles sample as nothing.
+class TextureHandle {
+public:
+    TextureFilter filter;
+    TextureWrap wrap;
+
+    TextureHandle() : filter(TextureFilter::TRILINEAR), wrap(TextureWrap::REPEAT), entry(nullptr) {}
+
+    TextureHandle(const TextureHandle& other) : filter(other.filter), wrap(other.wrap), entry(other.entry) {
+        if (entry != nullptr)
+            TextureCache::instance().retain(entry);
+    }
+
+    TextureHandle& operator=(const TextureHandle& other) {
+        TextureHandle copy(other);
+        std::swap(entry, copy.entry);
+        filter = other.filter;
+        wrap = other.wrap;
+        return *this;
+    }
+
+    ~TextureHandle() {
+        if (entry != nullptr)
+            TextureCache::instance().release(entry);
+    }
+
+    explicit operator bool() const { return entry != nullptr; }
+    const std::string& path() const { return entry->path; }
+
+    // false if the texture cannot be loaded
+    bool sample(const Vec3& uv, const Vec3& duvdx, const Vec3& duvdy, Vec3& color) const {
+        const Texture* texture = TextureCache::instance().acquire(entry);
+        if (texture == nullptr)
+            return false;
+        color = texture->sample(uv, duvdx, duvdy, filter, wrap);
+        return true;
+    }
+
+private:
+    friend class TextureCache;
+    TextureCache::Entry* entry;
+
+    explicit TextureHandle(TextureCache::Entry* e) :
+        filter(TextureFilter::TRILINEAR), wrap(TextureWrap::REPEAT), entry(e) {}
+};
+
+inline TextureHandle TextureCache::get(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry*& e = entries[path];
+    if (e == nullptr) {
+        e = new Entry();
+        e->path = path;
+        e->refs = 0;
+        e->texture = nullptr;
+        e->last_use = 0;
+        e->bytes = 0;
+        e->failed = false;
+    }
+    e->refs++;
+    return TextureHandle(e);
+}
+
+#endif // TEXTURE_HPP_
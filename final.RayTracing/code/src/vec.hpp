@@ -58,11 +58,19 @@ struct Vec3
         return x>eps || x<-eps || y>eps || y<-eps || z>eps || z<-eps;
     }
 
-    static Vec3 random_in_unit_disk(unsigned short* Xi) {
-        while (true) {
-            auto p = Vec3(erand48(Xi) * 2 - 1., erand48(Xi) * 2 - 1.);
-            if (p.len() < 1) return p;
+    // map a uniform sample u in [0, 1)^2 onto the unit disk (concentric mapping)
+    static Vec3 random_in_unit_disk(const Vec3& u) {
+        double a = 2 * u.x - 1, b = 2 * u.y - 1;
+        if (a == 0 && b == 0) return Vec3();
+        double r, phi;
+        if (a * a > b * b) {
+            r = a;
+            phi = M_PI / 4 * (b / a);
+        } else {
+            r = b;
+            phi = M_PI / 2 - M_PI / 4 * (a / b);
         }
+        return Vec3(r * cos(phi), r * sin(phi));
     }
 };
 